@@ -109,9 +109,15 @@ LOCAL_STATIC_LIBRARIES := \
 LOCAL_SRC_FILES := \
     boot/main.cpp \
     boot/bootimg.cpp \
+    boot/boot_patch.cpp \
     boot/compress.cpp \
+    boot/parallel.cpp \
+    boot/bench.cpp \
+    boot/batch.cpp \
+    boot/info.cpp \
     boot/format.cpp \
     boot/dtb.cpp \
+    boot/sparse.cpp \
     boot/boot-rs.cpp
 
 include $(BUILD_EXECUTABLE)
@@ -2,6 +2,7 @@
 #include <sys/sendfile.h>
 #include <sys/sysmacros.h>
 #include <linux/fs.h>
+#include <linux/falloc.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <libgen.h>
@@ -240,6 +241,27 @@ void write_zero(int fd, size_t size) {
     }
 }
 
+void write_hole(int fd, size_t size) {
+    struct stat st;
+    off_t pos = lseek(fd, 0, SEEK_CUR);
+    if (size == 0 || pos < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        write_zero(fd, size);
+        return;
+    }
+    off_t end = pos + size;
+    // Deallocate existing data within the range, and extend the file past its end
+    bool ok = pos >= st.st_size ||
+              fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                        pos, std::min(end, st.st_size) - pos) == 0;
+    ok = ok && (end <= st.st_size || ftruncate(fd, end) == 0);
+    if (ok) {
+        lseek(fd, end, SEEK_SET);
+    } else {
+        // Filesystem does not support holes
+        write_zero(fd, size);
+    }
+}
+
 void file_readline(bool trim, FILE *fp, const function<bool(string_view)> &fn) {
     size_t len = 1024;
     char *buf = (char *) malloc(len);
@@ -84,6 +84,9 @@ void full_read(const char *filename, std::string &str);
 std::string full_read(int fd);
 std::string full_read(const char *filename);
 void write_zero(int fd, size_t size);
+// Same as write_zero, but regular files get a hole instead of actual zeros
+// where possible, so the range costs neither I/O nor disk space
+void write_hole(int fd, size_t size);
 void file_readline(bool trim, FILE *fp, const std::function<bool(std::string_view)> &fn);
 void file_readline(bool trim, const char *file, const std::function<bool(std::string_view)> &fn);
 void file_readline(const char *file, const std::function<bool(std::string_view)> &fn);
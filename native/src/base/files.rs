@@ -135,6 +135,45 @@ impl<T: Read + Seek> ReadSeekExt for T {
     }
 }
 
+pub trait WriteSeekExt {
+    fn write_hole(&mut self, len: usize) -> io::Result<()>;
+}
+
+impl<T: Write + Seek + AsRawFd> WriteSeekExt for T {
+    fn write_hole(&mut self, len: usize) -> io::Result<()> {
+        // Same as write_zeros, but regular files get a hole instead where possible
+        let fd = self.as_raw_fd();
+        let mut st: libc::stat = unsafe { mem::zeroed() };
+        if len == 0
+            || unsafe { libc::fstat(fd, &mut st) } < 0
+            || (st.st_mode as u32 & libc::S_IFMT as u32) != libc::S_IFREG as u32
+        {
+            return self.write_zeros(len);
+        }
+        let pos = self.stream_position()?;
+        let end = pos + len as u64;
+        let size = st.st_size as u64;
+        // Deallocate existing data within the range, and extend the file past its end
+        let ok = unsafe {
+            (pos >= size
+                || libc::fallocate64(
+                    fd,
+                    libc::FALLOC_FL_PUNCH_HOLE | libc::FALLOC_FL_KEEP_SIZE,
+                    pos as libc::off64_t,
+                    (min(end, size) - pos) as libc::off64_t,
+                ) == 0)
+                && (end <= size || libc::ftruncate64(fd, end as libc::off64_t) == 0)
+        };
+        if ok {
+            self.seek(SeekFrom::Start(end))?;
+            Ok(())
+        } else {
+            // Filesystem does not support holes
+            self.write_zeros(len)
+        }
+    }
+}
+
 pub trait BufReadExt {
     fn foreach_lines<F: FnMut(&mut String) -> bool>(&mut self, f: F);
     fn foreach_props<F: FnMut(&str, &str) -> bool>(&mut self, f: F);
@@ -0,0 +1,334 @@
+use std::ops::Range;
+
+use byteorder::{BigEndian, ByteOrder};
+use sha2::{Digest, Sha256};
+
+// https://android.googlesource.com/platform/external/avb/+/refs/heads/android11-release/libavb/avb_vbmeta_image.h
+const VBMETA_HEADER_SIZE: usize = 256;
+const VBMETA_AUTH_SIZE: Range<usize> = 12..20;
+const VBMETA_ALGORITHM: Range<usize> = 28..32;
+const VBMETA_DESC_OFFSET: Range<usize> = 96..104;
+const VBMETA_DESC_SIZE: Range<usize> = 104..112;
+
+// https://android.googlesource.com/platform/external/avb/+/refs/heads/android11-release/libavb/avb_hash_descriptor.h
+const DESCRIPTOR_HEADER_SIZE: usize = 16;
+const HASH_DESCRIPTOR_SIZE: usize = 132;
+const HASH_IMAGE_SIZE: Range<usize> = 16..24;
+const HASH_ALGORITHM: Range<usize> = 24..56;
+const HASH_NAME_LEN: Range<usize> = 56..60;
+const HASH_SALT_LEN: Range<usize> = 60..64;
+const HASH_DIGEST_LEN: Range<usize> = 64..68;
+
+const DESCRIPTOR_TAG_HASH: u64 = 2;
+
+fn be_u64(buf: &[u8], r: Range<usize>) -> u64 {
+    BigEndian::read_u64(&buf[r])
+}
+
+fn be_u32(buf: &[u8], r: Range<usize>) -> usize {
+    BigEndian::read_u32(&buf[r]) as usize
+}
+
+fn shift(r: Range<usize>, off: usize) -> Range<usize> {
+    r.start + off..r.end + off
+}
+
+// A hash descriptor, with all ranges relative to the start of vbmeta
+struct HashDescriptor {
+    name: String,
+    algorithm: String,
+    image_size: Range<usize>,
+    salt: Range<usize>,
+    digest: Range<usize>,
+}
+
+impl HashDescriptor {
+    fn is_sha256(&self) -> bool {
+        self.algorithm == "sha256" && self.digest.len() == 32
+    }
+}
+
+// All well-formed hash descriptors in vbmeta
+fn hash_descriptors(vbmeta: &[u8]) -> Vec<HashDescriptor> {
+    let mut list = Vec::new();
+    if vbmeta.len() < VBMETA_HEADER_SIZE {
+        return list;
+    }
+    let start = (VBMETA_HEADER_SIZE as u64)
+        .saturating_add(be_u64(vbmeta, VBMETA_AUTH_SIZE))
+        .saturating_add(be_u64(vbmeta, VBMETA_DESC_OFFSET));
+    let end = start.saturating_add(be_u64(vbmeta, VBMETA_DESC_SIZE));
+    if end > vbmeta.len() as u64 {
+        return list;
+    }
+    let end = end as usize;
+
+    let mut off = start as usize;
+    while end - off >= DESCRIPTOR_HEADER_SIZE {
+        let len = be_u64(vbmeta, off + 8..off + 16);
+        if len > (end - off - DESCRIPTOR_HEADER_SIZE) as u64 {
+            break;
+        }
+        let desc = &vbmeta[off..off + DESCRIPTOR_HEADER_SIZE + len as usize];
+        let desc_off = off;
+        off += desc.len();
+        if be_u64(desc, 0..8) != DESCRIPTOR_TAG_HASH || desc.len() < HASH_DESCRIPTOR_SIZE {
+            continue;
+        }
+
+        let name_len = be_u32(desc, HASH_NAME_LEN);
+        let salt_len = be_u32(desc, HASH_SALT_LEN);
+        let digest_len = be_u32(desc, HASH_DIGEST_LEN);
+        let Some(salt_off) = HASH_DESCRIPTOR_SIZE.checked_add(name_len) else {
+            continue;
+        };
+        let Some(digest_off) = salt_off.checked_add(salt_len) else {
+            continue;
+        };
+        let Some(digest_end) = digest_off.checked_add(digest_len) else {
+            continue;
+        };
+        if digest_end > desc.len() {
+            continue;
+        }
+        let algo = &desc[HASH_ALGORITHM];
+        let algo = &algo[..algo.iter().position(|&c| c == 0).unwrap_or(algo.len())];
+        list.push(HashDescriptor {
+            name: String::from_utf8_lossy(&desc[HASH_DESCRIPTOR_SIZE..salt_off]).into_owned(),
+            algorithm: String::from_utf8_lossy(algo).into_owned(),
+            image_size: shift(HASH_IMAGE_SIZE, desc_off),
+            salt: desc_off + salt_off..desc_off + digest_off,
+            digest: desc_off + digest_off..desc_off + digest_end,
+        });
+    }
+    list
+}
+
+// The descriptor that describes partition: the only hash descriptor, or else the
+// one named after the partition. Other partitions in chained or combined vbmeta
+// images cannot be hashed from this image, and are left alone.
+fn partition_descriptor(vbmeta: &[u8], partition: &str) -> Option<HashDescriptor> {
+    let list = hash_descriptors(vbmeta);
+    let single = list.len() == 1;
+    let mut found = None;
+    for d in list {
+        if single || d.name == partition {
+            found = Some(d);
+        } else {
+            eprintln!("! Skip AVB hash descriptor of [{}]", d.name);
+        }
+    }
+    let d = found?;
+    if !d.is_sha256() {
+        eprintln!(
+            "! Unsupported AVB hash algorithm [{}] of [{}]",
+            d.algorithm, d.name
+        );
+        return None;
+    }
+    Some(d)
+}
+
+fn avb_digest(salt: &[u8], image: &[u8]) -> [u8; 32] {
+    let mut h = Sha256::new();
+    h.update(salt);
+    h.update(image);
+    h.finalize().into()
+}
+
+// Regenerate the digest of the hash descriptor of partition in vbmeta for image
+pub fn update_avb_hashes(image: &[u8], vbmeta: &mut [u8], partition: &str) {
+    let Some(d) = partition_descriptor(vbmeta, partition) else {
+        return;
+    };
+    let digest = avb_digest(&vbmeta[d.salt.clone()], image);
+    vbmeta[d.digest].copy_from_slice(&digest);
+    BigEndian::write_u64(&mut vbmeta[d.image_size], image.len() as u64);
+    eprintln!("VBMETA_HASH [{}]", d.name);
+
+    if be_u32(vbmeta, VBMETA_ALGORITHM) != 0 {
+        eprintln!("! vbmeta signature is no longer valid");
+    }
+}
+
+// Check the digest of the hash descriptor of partition in vbmeta against image
+pub fn verify_avb_hashes(image: &[u8], vbmeta: &[u8], partition: &str) -> bool {
+    let Some(d) = partition_descriptor(vbmeta, partition) else {
+        eprintln!("! No AVB hash descriptor to verify");
+        return false;
+    };
+    be_u64(vbmeta, d.image_size) == image.len() as u64
+        && vbmeta[d.digest] == avb_digest(&vbmeta[d.salt], image)
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn hex(lines: &[&str]) -> Vec<u8> {
+        let s = lines.concat();
+        (0..s.len())
+            .step_by(2)
+            .map(|i| u8::from_str_radix(&s[i..i + 2], 16).unwrap())
+            .collect()
+    }
+
+    // Contents of the image that add_hash_footer was run on
+    fn image(len: usize) -> Vec<u8> {
+        (0..len).map(|i| (i * 7 + 3) as u8).collect()
+    }
+
+    // vbmeta blobs of image(3000) and image(5000), as encoded by avbtool.py for
+    //   avbtool add_hash_footer --partition_name boot --algorithm NONE \
+    //     --salt 5a5a5a5a5a5a5a5ac3c3c3c3c3c3c3c3
+    // Descriptors are in the auxiliary block, which is padded to 64 bytes.
+    const VBMETA_3000: &[&str] = &[
+        "415642300000000100000000000000000000000000000000000000c000000000000000000000000000000000",
+        "000000000000000000000000000000000000000000000000000000b8000000000000000000000000000000b8",
+        "0000000000000000000000000000000000000000000000b80000000000000000000000000000000061766274",
+        "6f6f6c20312e322e300000000000000000000000000000000000000000000000000000000000000000000000",
+        "0000000000000000000000000000000000000000000000000000000000000000000000000000000000000000",
+        "0000000000000000000000000000000000000000000000000000000000000000000000000000000000000002",
+        "00000000000000a80000000000000bb873686132353600000000000000000000000000000000000000000000",
+        "0000000000000004000000100000002000000000000000000000000000000000000000000000000000000000",
+        "000000000000000000000000000000000000000000000000000000000000000000000000626f6f745a5a5a5a",
+        "5a5a5a5ac3c3c3c3c3c3c3c3946a5e704ee7029cbab7e5bffdfd62fb82e2b7fca2fa360c6c5c9be32bebe6a1",
+        "0000000000000000",
+    ];
+    const VBMETA_5000: &[&str] = &[
+        "415642300000000100000000000000000000000000000000000000c000000000000000000000000000000000",
+        "000000000000000000000000000000000000000000000000000000b8000000000000000000000000000000b8",
+        "0000000000000000000000000000000000000000000000b80000000000000000000000000000000061766274",
+        "6f6f6c20312e322e300000000000000000000000000000000000000000000000000000000000000000000000",
+        "0000000000000000000000000000000000000000000000000000000000000000000000000000000000000000",
+        "0000000000000000000000000000000000000000000000000000000000000000000000000000000000000002",
+        "00000000000000a8000000000000138873686132353600000000000000000000000000000000000000000000",
+        "0000000000000004000000100000002000000000000000000000000000000000000000000000000000000000",
+        "000000000000000000000000000000000000000000000000000000000000000000000000626f6f745a5a5a5a",
+        "5a5a5a5ac3c3c3c3c3c3c3c3b493d5b2fdd4371fe75c542540125412a6a02d64613e7930a70b63259fdc5b25",
+        "0000000000000000",
+    ];
+
+    fn hash_descriptor(algo: &str, name: &str, salt: &[u8]) -> Vec<u8> {
+        let digest_len = if algo == "sha256" { 32 } else { 20 };
+        let mut d = vec![0u8; HASH_DESCRIPTOR_SIZE];
+        BigEndian::write_u64(&mut d[0..8], DESCRIPTOR_TAG_HASH);
+        BigEndian::write_u64(&mut d[HASH_IMAGE_SIZE], 1);
+        d[HASH_ALGORITHM][..algo.len()].copy_from_slice(algo.as_bytes());
+        BigEndian::write_u32(&mut d[HASH_NAME_LEN], name.len() as u32);
+        BigEndian::write_u32(&mut d[HASH_SALT_LEN], salt.len() as u32);
+        BigEndian::write_u32(&mut d[HASH_DIGEST_LEN], digest_len);
+        d.extend_from_slice(name.as_bytes());
+        d.extend_from_slice(salt);
+        d.extend(std::iter::repeat(0xee).take(digest_len as usize));
+        d.resize((d.len() + 7) & !7, 0);
+        let len = (d.len() - DESCRIPTOR_HEADER_SIZE) as u64;
+        BigEndian::write_u64(&mut d[8..16], len);
+        d
+    }
+
+    // Header, an authentication block, and the descriptors in the auxiliary block
+    fn vbmeta(descriptors: &[Vec<u8>]) -> Vec<u8> {
+        let auth_size = 64u64;
+        let desc: Vec<u8> = descriptors.concat();
+        let mut v = vec![0u8; VBMETA_HEADER_SIZE];
+        v[..4].copy_from_slice(b"AVB0");
+        BigEndian::write_u64(&mut v[VBMETA_AUTH_SIZE], auth_size);
+        BigEndian::write_u64(&mut v[20..28], 8 + desc.len() as u64);
+        BigEndian::write_u64(&mut v[VBMETA_DESC_OFFSET], 8);
+        BigEndian::write_u64(&mut v[VBMETA_DESC_SIZE], desc.len() as u64);
+        v.resize(VBMETA_HEADER_SIZE + auth_size as usize + 8, 0);
+        v.extend_from_slice(&desc);
+        v
+    }
+
+    #[test]
+    fn avbtool_footer() {
+        let mut v = hex(VBMETA_3000);
+        update_avb_hashes(&image(5000), &mut v, "boot");
+        assert_eq!(v, hex(VBMETA_5000));
+
+        // The only descriptor is updated even if the partition is named differently
+        let mut v = hex(VBMETA_5000);
+        update_avb_hashes(&image(3000), &mut v, "recovery");
+        assert_eq!(v, hex(VBMETA_3000));
+    }
+
+    #[test]
+    fn verify() {
+        let v = hex(VBMETA_3000);
+        assert!(verify_avb_hashes(&image(3000), &v, "boot"));
+        assert!(!verify_avb_hashes(&image(2999), &v, "boot"));
+        let mut image = image(3000);
+        image[1234] ^= 1;
+        assert!(!verify_avb_hashes(&image, &v, "boot"));
+    }
+
+    #[test]
+    fn other_partitions() {
+        let salt = [0x5a; 32];
+        let mut v = vbmeta(&[
+            // A non-hash descriptor (property) is skipped
+            {
+                let mut p = vec![0u8; 24];
+                BigEndian::write_u64(&mut p[8..16], 8);
+                p
+            },
+            hash_descriptor("sha256", "dtbo", &salt),
+            hash_descriptor("sha256", "boot", &salt),
+            hash_descriptor("sha256", "vendor_boot", &salt),
+        ]);
+        let orig = v.clone();
+        let image = image(4096);
+        update_avb_hashes(&image, &mut v, "boot");
+
+        let list = hash_descriptors(&v);
+        assert_eq!(list.len(), 3);
+        for d in list {
+            if d.name == "boot" {
+                assert_eq!(be_u64(&v, d.image_size), image.len() as u64);
+                assert_eq!(v[d.digest], avb_digest(&salt, &image));
+            } else {
+                assert_eq!(
+                    v[d.image_size.start..d.digest.end],
+                    orig[d.image_size.start..d.digest.end]
+                );
+            }
+        }
+
+        // Without a descriptor of the partition, nothing is touched
+        let mut v = orig.clone();
+        update_avb_hashes(&image, &mut v, "init_boot");
+        assert_eq!(v, orig);
+    }
+
+    #[test]
+    fn unsupported_algorithm() {
+        let mut v = vbmeta(&[hash_descriptor("sha1", "boot", &[1, 2, 3])]);
+        let orig = v.clone();
+        update_avb_hashes(&image(64), &mut v, "boot");
+        assert_eq!(v, orig);
+    }
+
+    #[test]
+    fn corrupted() {
+        let image = image(64);
+        let mut v = vbmeta(&[hash_descriptor("sha256", "boot", &[])]);
+
+        // Descriptor that claims to be longer than the descriptor block
+        let mut bad = v.clone();
+        let desc = VBMETA_HEADER_SIZE + 64 + 8;
+        BigEndian::write_u64(&mut bad[desc + 8..desc + 16], u64::MAX);
+        let orig = bad.clone();
+        update_avb_hashes(&image, &mut bad, "boot");
+        assert_eq!(bad, orig);
+
+        // Descriptor block outside of vbmeta
+        BigEndian::write_u64(&mut v[VBMETA_DESC_SIZE], u64::MAX - 1);
+        let orig = v.clone();
+        update_avb_hashes(&image, &mut v, "boot");
+        assert_eq!(v, orig);
+
+        update_avb_hashes(&image, &mut v[..100], "boot");
+    }
+}
@@ -0,0 +1,214 @@
+#include <pthread.h>
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+#include <base.hpp>
+
+#include "bootimg.hpp"
+#include "magiskboot.hpp"
+#include "parallel.hpp"
+
+using namespace std;
+
+static void usage() {
+    fprintf(stderr,
+R"EOF(batch [-j jobs] [-d dir] [-o report] <manifest>
+  Process all boot images listed in <manifest> within a single process.
+  Each line is '<bootimg> <op>[,<op>...] [outbootimg]'; empty lines and
+  lines starting with '#' are ignored. Operations run in order:
+    unpack  Decompress all components into the working directory
+    verify  Report whether the image is signed with AVB 1.0 signature, and
+            check the AVB hash descriptor of images with an AVB footer
+    patch   Same as the 'patch' action, to [outbootimg]
+    repack  Repack the components in the working directory to [outbootimg]
+  Each image gets its own working directory '<dir>/<line number>', and
+  [outbootimg] defaults to 'new-boot.img' in there.
+  A JSON object with per-stage timings is reported for each image. An image
+  that fails does not stop the others.
+  -j  number of images processed at the same time (default: max threads)
+      The threads are split between the images processed at the same time.
+  -d  parent of all working directories (default: batch)
+  -o  file to write the report to (default: stdout)
+)EOF");
+    exit(1);
+}
+
+namespace {
+
+struct batch_entry {
+    int line;
+    string image;
+    vector<string> ops;
+    string out;
+};
+
+struct batch_stage {
+    string op;
+    bool ok;
+    double secs;
+};
+
+} // namespace
+
+// Run op on an image with at most threads threads per component.
+// The working directory holds the unpacked components.
+static bool run_op(string_view op, const boot_img &boot, const string &dir, int dirfd,
+                   const string &out, int threads, string &extra) {
+    if (op == "unpack") {
+        boot_parts parts;
+        bool ok = unpack(boot, parts, threads);
+        return dump_parts(dirfd, parts) && ok;
+    } else if (op == "verify") {
+        extra += boot.flags[AVB1_SIGNED_FLAG] ? ",\"signed\":true" : ",\"signed\":false";
+        if (!boot.flags[AVB_FLAG])
+            return true;
+        bool ok = boot.verify_avb();
+        extra += ok ? ",\"avb\":true" : ",\"avb\":false";
+        return ok;
+    } else if (op == "patch") {
+        int ret = boot_patch(boot, out.data(), threads);
+        if (ret == 2)
+            extra += ",\"chromeos\":true";
+        return ret != 1;
+    } else if (op == "repack") {
+        boot_parts parts;
+        load_parts(dirfd, parts);
+        string header = dir + "/" HEADER_FILE;
+        if (access(header.data(), R_OK) == 0)
+            parts.header_file = header.data();
+        repack_opts opts;
+        opts.threads = threads;
+        return repack(boot, parts, out.data(), opts);
+    }
+    return false;
+}
+
+static string run_entry(const batch_entry &e, const string &root, int threads, bool &ok) {
+    using clock = chrono::steady_clock;
+    auto elapsed = [](clock::time_point since) {
+        return chrono::duration<double>(clock::now() - since).count();
+    };
+    auto begin = clock::now();
+
+    string dir = root + "/" + to_string(e.line);
+    string out = e.out.empty() ? dir + "/" NEW_BOOT : e.out;
+    string extra;
+    vector<batch_stage> stages;
+
+    ok = false;
+    if (access(e.image.data(), R_OK) != 0) {
+        stages.push_back({"parse", false, 0});
+    } else if (mkdirs(dir.data(), 0755) != 0) {
+        stages.push_back({"mkdir", false, 0});
+    } else if (int dirfd = xopen(dir.data(), O_RDONLY | O_DIRECTORY | O_CLOEXEC); dirfd < 0) {
+        stages.push_back({"open", false, 0});
+    } else {
+        auto start = clock::now();
+        const boot_img boot(e.image.data(), false);
+        ok = boot.hdr != nullptr;
+        stages.push_back({"parse", ok, elapsed(start)});
+
+        for (size_t i = 0; ok && i < e.ops.size(); ++i) {
+            start = clock::now();
+            ok = run_op(e.ops[i], boot, dir, dirfd, out, threads, extra);
+            stages.push_back({e.ops[i], ok, elapsed(start)});
+        }
+        close(dirfd);
+    }
+
+    char buf[64];
+    string r = "{\"line\":" + to_string(e.line);
+    r += ",\"image\":" + json_str(e.image);
+    r += ",\"workdir\":" + json_str(dir);
+    r += ok ? ",\"ok\":true,\"stages\":[" : ",\"ok\":false,\"stages\":[";
+    for (size_t i = 0; i < stages.size(); ++i) {
+        r += i ? ",{\"op\":" : "{\"op\":";
+        r += json_str(stages[i].op);
+        ssprintf(buf, sizeof(buf), ",\"ok\":%s,\"seconds\":%.6f}",
+                 stages[i].ok ? "true" : "false", stages[i].secs);
+        r += buf;
+    }
+    ssprintf(buf, sizeof(buf), "],\"seconds\":%.6f", elapsed(begin));
+    r += buf;
+    r += extra;
+    r += "}\n";
+    return r;
+}
+
+int batch_commands(int argc, char *argv[]) {
+    int jobs = 0;
+    const char *root = "batch";
+    const char *report = nullptr;
+
+    int idx = 1;
+    for (; idx + 1 < argc && argv[idx][0] == '-'; idx += 2) {
+        if (argv[idx] == "-j"sv) {
+            if ((jobs = parse_int(argv[idx + 1])) <= 0)
+                usage();
+        } else if (argv[idx] == "-d"sv) {
+            root = argv[idx + 1];
+        } else if (argv[idx] == "-o"sv) {
+            report = argv[idx + 1];
+        } else {
+            usage();
+        }
+    }
+    if (idx + 1 != argc)
+        usage();
+
+    vector<batch_entry> entries;
+    int line = 0;
+    file_readline(true, argv[idx], [&](string_view s) -> bool {
+        ++line;
+        if (s.empty() || s[0] == '#')
+            return true;
+        auto args = split(s, " \t");
+        args.erase(remove(args.begin(), args.end(), ""), args.end());
+        if (args.size() < 2 || args.size() > 3) {
+            fprintf(stderr, "Invalid manifest line %d\n", line);
+            usage();
+        }
+        batch_entry e{line, args[0], split(args[1], ","), args.size() > 2 ? args[2] : ""};
+        for (auto &op : e.ops) {
+            if (op != "unpack" && op != "verify" && op != "patch" && op != "repack") {
+                fprintf(stderr, "Unknown operation [%s] on manifest line %d\n", op.data(), line);
+                usage();
+            }
+        }
+        entries.push_back(std::move(e));
+        return true;
+    });
+
+    if (mkdirs(root, 0755) != 0)
+        LOGE("Cannot create directory [%s]\n", root);
+    FILE *fp = report ? xfopen(report, "we") : stdout;
+    if (fp == nullptr)
+        return 1;
+
+    // Each image gets an equal share of the threads, so that running jobs images
+    // at the same time neither oversubscribes the CPU nor multiplies the memory
+    // used by the per-thread buffers of the encoders and decoders
+    size_t running = std::min<size_t>(entries.size(), jobs > 0 ? jobs : max_threads());
+    int threads = std::max<int>(1, max_threads() / std::max<size_t>(1, running));
+
+    // A failure in one image is reported in its result, instead of exiting and losing
+    // the results of all the other images
+    exit_on_error(false);
+
+    // Results are written as soon as each image finishes
+    pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    bool all_ok = true;
+    parallel_for(entries.size(), [&](size_t i) {
+        bool ok;
+        string r = run_entry(entries[i], root, threads, ok);
+        mutex_guard g(lock);
+        all_ok &= ok;
+        fputs(r.data(), fp);
+        fflush(fp);
+    }, jobs);
+
+    if (report)
+        fclose(fp);
+    return all_ok ? 0 : 1;
+}
@@ -0,0 +1,473 @@
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <deque>
+#include <vector>
+
+#include <base.hpp>
+
+#include "boot-rs.hpp"
+#include "bootimg.hpp"
+#include "magiskboot.hpp"
+#include "compress.hpp"
+#include "parallel.hpp"
+
+using namespace std;
+
+// Same slice size the compress/decompress CLI feeds the codecs with
+constexpr size_t SLICE_SZ = 0x800000;
+constexpr size_t CPIO_ENTRY_SZ = 0x10000;
+constexpr size_t BENCH_PAGE_SZ = 4096;
+
+static void usage() {
+    fprintf(stderr,
+R"EOF(bench [-n iterations] [-s size] [-l level] [-f formats] [-t threads] [file...]
+  Measure the throughput of all compression formats, hexpatch, cpio and
+  boot image parsing over synthetic corpora and the provided files.
+  Results are printed to stdout, one JSON object per line.
+  -n  number of runs per measurement, the fastest is reported (default: 3)
+  -s  size of each synthetic corpus, K or M suffix allowed (default: 8M)
+      Use 0 to only run over the provided files.
+  -l  compression level, defaults to the same as 'compress'
+  -f  comma separated list of formats to run (default: all)
+  -t  comma separated list of thread counts to run the formats with, which
+      also turns on the block encoders (default: max threads)
+)EOF");
+    exit(1);
+}
+
+size_t parse_size(string_view s) {
+    size_t shift = 0;
+    if (str_ends(s, "K") || str_ends(s, "k")) {
+        shift = 10;
+    } else if (str_ends(s, "M") || str_ends(s, "m")) {
+        shift = 20;
+    } else if (str_ends(s, "G") || str_ends(s, "g")) {
+        shift = 30;
+    }
+    if (shift)
+        s.remove_suffix(1);
+    if (s.empty())
+        return SIZE_MAX;
+    uint64_t n = 0;
+    for (char c : s) {
+        if (c < '0' || c > '9' || n > (UINT64_MAX - 9) / 10)
+            return SIZE_MAX;
+        n = n * 10 + (c - '0');
+    }
+    if (n > (SIZE_MAX >> shift))
+        return SIZE_MAX;
+    return (size_t) n << shift;
+}
+
+string json_str(string_view s) {
+    string r = "\"";
+    for (char c : s) {
+        if (c == '"' || c == '\\') {
+            r += '\\';
+            r += c;
+        } else if ((unsigned char) c < 0x20) {
+            char buf[8];
+            ssprintf(buf, sizeof(buf), "\\u%04x", c);
+            r += buf;
+        } else {
+            r += c;
+        }
+    }
+    r += '"';
+    return r;
+}
+
+static double now() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Writing 5 to clear_refs resets the peak RSS (VmHWM) of the process
+static void reset_peak_rss() {
+    int fd = open("/proc/self/clear_refs", O_WRONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        if (write(fd, "5", 1) != 1)
+            fprintf(stderr, "! Cannot reset peak RSS, it covers earlier runs\n");
+        close(fd);
+    }
+}
+
+static long peak_rss_kb() {
+    long kb = -1;
+    file_readline("/proc/self/status", [&](string_view line) -> bool {
+        if (str_starts(line, "VmHWM:")) {
+            kb = strtol(line.data() + 6, nullptr, 10);
+            return false;
+        }
+        return true;
+    });
+    if (kb < 0) {
+        rusage ru;
+        getrusage(RUSAGE_SELF, &ru);
+        kb = ru.ru_maxrss;
+    }
+    return kb;
+}
+
+// Some operations are chatty on stderr, which would dominate small runs
+struct quiet_stderr {
+    quiet_stderr() : fd(dup(STDERR_FILENO)) {
+        int null = open("/dev/null", O_WRONLY | O_CLOEXEC);
+        dup2(null, STDERR_FILENO);
+        close(null);
+    }
+    ~quiet_stderr() {
+        dup2(fd, STDERR_FILENO);
+        close(fd);
+    }
+private:
+    int fd;
+};
+
+struct tmp_file {
+    tmp_file() {
+        const char *dir = getenv("TMPDIR");
+        path = string(dir && dir[0] ? dir : "/tmp") + "/magiskboot-bench-XXXXXX";
+        fd = mkostemp(path.data(), O_CLOEXEC);
+        if (fd < 0)
+            PLOGE("Create temporary file [%s]", path.data());
+    }
+    ~tmp_file() {
+        close(fd);
+        unlink(path.data());
+    }
+    void reset() const {
+        ftruncate(fd, 0);
+        lseek(fd, 0, SEEK_SET);
+    }
+    size_t size() const {
+        struct stat st;
+        fstat(fd, &st);
+        return st.st_size;
+    }
+
+    string path;
+    int fd;
+};
+
+struct bench_opts {
+    int iterations = 3;
+    encoder_opts enc;
+};
+
+struct bench_result {
+    double secs = 1e30;
+    long rss_kb = 0;
+    size_t out_sz = 0;
+    bool ok = true;
+};
+
+// Runs fn several times, keeping the fastest run. fn returns false on failure.
+template <class Fn>
+static bench_result measure(const bench_opts &opts, Fn &&fn) {
+    bench_result r;
+    reset_peak_rss();
+    for (int i = 0; i < opts.iterations; ++i) {
+        double start = now();
+        r.ok = fn() && r.ok;
+        r.secs = std::min(r.secs, now() - start);
+    }
+    r.rss_kb = peak_rss_kb();
+    return r;
+}
+
+static void report(string_view corpus, size_t in_sz, const char *op, const char *fmt,
+                   const char *path, const bench_result &r) {
+    string name = json_str(corpus);
+    printf(R"({"corpus":%s,"bytes":%zu,"op":"%s","format":"%s","path":"%s","threads":%d,)"
+           R"("ok":%s,"seconds":%.6f,"mb_s":%.2f,"ratio":%.4f,"peak_rss_kb":%ld})" "\n",
+           name.data(), in_sz, op, fmt, path, max_threads(), r.ok ? "true" : "false",
+           r.secs, in_sz / r.secs / (1 << 20), in_sz ? (double) r.out_sz / in_sz : 0.0,
+           r.rss_kb);
+    fflush(stdout);
+}
+
+static bool write_slices(out_stream &strm, byte_view in) {
+    for (size_t off = 0; off < in.sz(); off += SLICE_SZ) {
+        if (!strm.write(in.buf() + off, std::min(SLICE_SZ, in.sz() - off)))
+            return false;
+    }
+    return true;
+}
+
+static void bench_format(const bench_opts &opts, string_view corpus, byte_view in, format_t fmt) {
+    const char *name = fmt2name[fmt];
+
+    heap_data encoded(0);
+    auto enc = measure(opts, [&]() -> bool {
+        heap_data out(0);
+        {
+            auto strm = get_encoder(fmt, make_unique<byte_channel>(out), opts.enc);
+            if (!write_slices(*strm, in))
+                return false;
+        }
+        encoded = std::move(out);
+        return true;
+    });
+    enc.out_sz = encoded.sz();
+    report(corpus, in.sz(), "encode", name, "buffer", enc);
+
+    // Decode through the streaming decoder (stdin and pipes), the in-memory
+    // decoder, and straight into a memory mapped file (regular files).
+    tmp_file tmp;
+    auto check = [&](size_t sz) { return sz == in.sz(); };
+
+    auto dec = measure(opts, [&]() -> bool {
+        tmp.reset();
+        {
+            auto strm = get_decoder(fmt, make_unique<fd_channel>(tmp.fd));
+            if (!write_slices(*strm, encoded))
+                return false;
+        }
+        return check(tmp.size());
+    });
+    dec.out_sz = encoded.sz();
+    report(corpus, in.sz(), "decode", name, "stream", dec);
+
+    dec = measure(opts, [&]() -> bool {
+        heap_data out(0);
+        if (!decompress(fmt, encoded, make_unique<byte_channel>(out)))
+            return false;
+        return check(out.sz()) && memcmp(out.buf(), in.buf(), in.sz()) == 0;
+    });
+    dec.out_sz = encoded.sz();
+    report(corpus, in.sz(), "decode", name, "buffer", dec);
+
+    dec = measure(opts, [&]() -> bool {
+        tmp.reset();
+        return decompress(fmt, encoded, tmp.fd) && check(tmp.size());
+    });
+    dec.out_sz = encoded.sz();
+    report(corpus, in.sz(), "decode", name, "direct", dec);
+}
+
+static void bench_hexpatch(const bench_opts &opts, string_view corpus, byte_view in) {
+    tmp_file tmp;
+    xwrite(tmp.fd, in.buf(), in.sz());
+    // A pattern that is unlikely to exist, so every run scans the whole file unmodified
+    auto r = measure(opts, [&]() -> bool {
+        hexpatch(byte_view(tmp.path), byte_view("DEADBEEFCAFEF00D0BADC0DE"),
+                 byte_view("000000000000000000000000"));
+        return true;
+    });
+    r.out_sz = in.sz();
+    report(corpus, in.sz(), "hexpatch", "", "", r);
+}
+
+// Split the corpus into files of a newc archive
+static void write_cpio(int fd, byte_view in) {
+    size_t ino = 0;
+    auto entry = [&](const char *name, uint32_t mode, const uint8_t *buf, size_t sz) {
+        char hdr[111];
+        size_t namesz = strlen(name) + 1;
+        ssprintf(hdr, sizeof(hdr), "070701%08zx%08x%08x%08x%08x%08x%08zx%08x%08x%08x%08x%08zx%08x",
+                 ino++, mode, 0, 0, 1, 0, sz, 0, 0, 0, 0, namesz, 0);
+        xwrite(fd, hdr, 110);
+        xwrite(fd, name, namesz);
+        write_zero(fd, align_padding(110 + namesz, 4));
+        xwrite(fd, buf, sz);
+        write_zero(fd, align_padding(sz, 4));
+    };
+    entry("bench", 040755, nullptr, 0);
+    char name[32];
+    for (size_t off = 0; off < in.sz(); off += CPIO_ENTRY_SZ) {
+        ssprintf(name, sizeof(name), "bench/%zu", off / CPIO_ENTRY_SZ);
+        entry(name, 0100644, in.buf() + off, std::min(CPIO_ENTRY_SZ, in.sz() - off));
+    }
+    entry("TRAILER!!!", 0, nullptr, 0);
+}
+
+static void bench_cpio(const bench_opts &opts, string_view corpus, byte_view in) {
+    tmp_file tmp;
+    write_cpio(tmp.fd, in);
+    size_t sz = tmp.size();
+    const char *argv[] = { tmp.path.data(), nullptr };
+    // No commands, the archive is just loaded and dumped back
+    auto r = measure(opts, [&]() -> bool {
+        quiet_stderr q;
+        return rust::cpio_commands(1, argv);
+    });
+    r.out_sz = tmp.size();
+    report(corpus, sz, "cpio", "", "", r);
+}
+
+// A header v0 image with the corpus as the kernel, which is scanned for DTBs
+static void write_bootimg(int fd, byte_view in, byte_view prefix = {}) {
+    xwrite(fd, prefix.buf(), prefix.sz());
+    boot_img_hdr_v0 hdr{};
+    memcpy(hdr.magic, BOOT_MAGIC, BOOT_MAGIC_SIZE);
+    hdr.kernel_size = in.sz();
+    hdr.page_size = BENCH_PAGE_SZ;
+    xwrite(fd, &hdr, sizeof(hdr));
+    write_zero(fd, BENCH_PAGE_SZ - sizeof(hdr));
+    xwrite(fd, in.buf(), in.sz());
+    write_zero(fd, align_padding(in.sz(), BENCH_PAGE_SZ));
+}
+
+static void bench_bootimg(const bench_opts &opts, string_view corpus, byte_view in) {
+    tmp_file tmp;
+    switch (check_fmt(in.buf(), in.sz())) {
+    case CHROMEOS:
+    case AOSP:
+    case AOSP_VENDOR:
+    case DHTB:
+    case BLOB:
+        // Parse user provided boot images as is
+        xwrite(tmp.fd, in.buf(), in.sz());
+        break;
+    default:
+        write_bootimg(tmp.fd, in);
+        break;
+    }
+    size_t sz = tmp.size();
+    auto r = measure(opts, [&]() -> bool {
+        quiet_stderr q;
+        boot_img boot(tmp.path.data());
+        return boot.hdr != nullptr;
+    });
+    r.out_sz = sz;
+    report(corpus, sz, "bootimg", "", "", r);
+}
+
+static void fill_text(heap_data &data) {
+    static const char *words[] = {
+        "android", "boot", "kernel", "ramdisk", "magisk", "init", "system", "vendor",
+        "partition", "image", "header", "the", "of", "and", "to", "a", "in", "is",
+        "0x00000000", "0xffffffff", "\n", "\t", "{", "}", "();", "return", "=", " ",
+    };
+    uint32_t seed = 0x12345678;
+    size_t off = 0;
+    while (off < data.sz()) {
+        seed = seed * 1103515245 + 12345;
+        const char *w = words[(seed >> 16) % std::size(words)];
+        size_t len = std::min(strlen(w), data.sz() - off);
+        memcpy(data.buf() + off, w, len);
+        off += len;
+    }
+}
+
+static void fill_random(heap_data &data) {
+    uint64_t x = 0x9E3779B97F4A7C15ULL;
+    for (size_t off = 0; off < data.sz(); ++off) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        data.buf()[off] = x >> 32;
+    }
+}
+
+// Images with a large pre-header before the Android header, like NOOKHD (1M) or
+// ACCLAIM (256K), measure how fast boot_img finds the header. The prefixes are
+// random data, and data made entirely of bytes that start a boot image magic.
+static void bench_bootimg_scan(const bench_opts &opts) {
+    heap_data kernel(BENCH_PAGE_SZ);
+    for (size_t sz : { NOOKHD_PRE_HEADER_SZ, ACCLAIM_PRE_HEADER_SZ }) {
+        for (const char *kind : { "random", "magic" }) {
+            heap_data prefix(sz);
+            if (kind == "random"sv) {
+                fill_random(prefix);
+            } else {
+                for (size_t i = 0; i < sz; ++i)
+                    prefix.buf()[i] = "ACDV-"[i % 5];
+            }
+            tmp_file tmp;
+            write_bootimg(tmp.fd, kernel, prefix);
+            size_t img_sz = tmp.size();
+            auto r = measure(opts, [&]() -> bool {
+                quiet_stderr q;
+                boot_img boot(tmp.path.data());
+                return boot.hdr != nullptr;
+            });
+            r.out_sz = img_sz;
+            string name = "preheader-"s + kind + "-" + to_string(sz >> 10) + "K";
+            report(name, img_sz, "bootimg", "", "", r);
+        }
+    }
+}
+
+int bench_commands(int argc, char *argv[]) {
+    bench_opts opts;
+    // Same as 'compress', gzip and xz use the block encoders with an explicit --threads
+    opts.enc.blocks = max_threads_set();
+    size_t synth_sz = 8 << 20;
+    vector<format_t> formats;
+    vector<int> thread_counts;
+
+    int idx = 1;
+    for (; idx + 1 < argc && argv[idx][0] == '-'; idx += 2) {
+        string_view flag(argv[idx]);
+        if (flag == "-n") {
+            if ((opts.iterations = parse_int(argv[idx + 1])) <= 0)
+                usage();
+        } else if (flag == "-s") {
+            if ((synth_sz = parse_size(argv[idx + 1])) == SIZE_MAX)
+                usage();
+        } else if (flag == "-l") {
+            if ((opts.enc.level = parse_int(argv[idx + 1])) < 0)
+                usage();
+        } else if (flag == "-f") {
+            for (auto &name : split(argv[idx + 1], ",")) {
+                format_t fmt = name2fmt[name];
+                if (!COMPRESSED(fmt))
+                    LOGE("Unknown compression method: [%s]\n", name.data());
+                formats.push_back(fmt);
+            }
+        } else if (flag == "-t") {
+            for (auto &n : split(argv[idx + 1], ",")) {
+                int threads = parse_int(n);
+                if (threads <= 0)
+                    usage();
+                thread_counts.push_back(threads);
+            }
+        } else {
+            usage();
+        }
+    }
+    int threads = max_threads();
+    if (thread_counts.empty())
+        thread_counts.push_back(threads);
+    else
+        opts.enc.blocks = true;
+    if (formats.empty()) {
+        for (int fmt = GZIP; fmt < LZOP; ++fmt)
+            formats.push_back((format_t) fmt);
+    }
+
+    deque<heap_data> synth;
+    deque<mmap_data> files;
+    vector<pair<string, byte_view>> corpora;
+    if (synth_sz) {
+        corpora.emplace_back("zero", synth.emplace_back(synth_sz));
+        fill_text(synth.emplace_back(synth_sz));
+        corpora.emplace_back("text", synth.back());
+        fill_random(synth.emplace_back(synth_sz));
+        corpora.emplace_back("random", synth.back());
+    }
+    for (; idx < argc; ++idx) {
+        corpora.emplace_back(argv[idx], files.emplace_back(argv[idx]));
+    }
+    if (corpora.empty())
+        usage();
+
+    for (auto &[name, data] : corpora) {
+        // Every result reports the thread count it was measured with
+        for (int n : thread_counts) {
+            set_max_threads(n);
+            for (format_t fmt : formats)
+                bench_format(opts, name, data, fmt);
+        }
+        set_max_threads(threads);
+        bench_hexpatch(opts, name, data);
+        bench_cpio(opts, name, data);
+        bench_bootimg(opts, name, data);
+    }
+    bench_bootimg_scan(opts);
+    return 0;
+}
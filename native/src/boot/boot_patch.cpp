@@ -0,0 +1,144 @@
+#include <functional>
+
+#include <base.hpp>
+
+#include "boot-rs.hpp"
+#include "bootimg.hpp"
+#include "magiskboot.hpp"
+#include "compress.hpp"
+#include "parallel.hpp"
+
+using namespace std;
+
+// Same as "magiskboot compress=xz <file>", but into memory.
+// A missing file is left empty, which is not an error.
+static bool compress_file(const char *file, heap_data &out, int threads) {
+    if (access(file, R_OK) != 0)
+        return true;
+    mmap_data in(file);
+    encoder_opts opts;
+    opts.threads = threads;
+    auto strm = get_encoder(XZ, make_unique<byte_channel>(out), opts);
+    if (!strm->write(in.buf(), in.sz())) {
+        fprintf(stderr, "! Unable to compress %s\n", file);
+        return false;
+    }
+    return true;
+}
+
+int boot_patch(const char *image, const char *out_img) {
+    fprintf(stderr, "- Unpacking boot image\n");
+    const boot_img boot(image);
+    return boot_patch(boot, out_img);
+}
+
+// This function does exactly what scripts/boot_patch.sh does between unpacking
+// and repacking, but everything stays in memory in a single process
+int boot_patch(const boot_img &boot, const char *out_img, int threads) {
+    // The ramdisk of v4 vendor boot images is split into multiple cpio archives
+    if (boot.hdr->is_vendor() && boot.hdr->header_version() >= 4) {
+        fprintf(stderr, "! Unable to patch ramdisk of v4 vendor boot image\n");
+        return 1;
+    }
+
+    if (threads <= 0)
+        threads = max_threads();
+    bool chromeos = boot.flags[CHROMEOS_FLAG];
+    if (chromeos)
+        fprintf(stderr, "- ChromeOS boot image detected\n");
+
+    // Compress the binaries to embed while the components are decompressed
+    boot_parts parts;
+    heap_data magisk32, magisk64, stub;
+    mmap_data magiskinit;
+    if (access("magiskinit", R_OK) == 0)
+        magiskinit = mmap_data("magiskinit");
+    vector<function<void()>> tasks;
+    bool unpacked = false;
+    bool compressed[3] = {};
+    tasks.emplace_back([&] { unpacked = unpack(boot, parts, threads); });
+    tasks.emplace_back([&] { compressed[0] = compress_file("magisk32", magisk32, threads); });
+    tasks.emplace_back([&] { compressed[1] = compress_file("magisk64", magisk64, threads); });
+    tasks.emplace_back([&] { compressed[2] = compress_file("stub.apk", stub, threads); });
+    parallel_for(tasks.size(), [&](size_t i) { tasks[i](); }, threads);
+    if (!unpacked) {
+        fprintf(stderr, "! Unable to unpack boot image\n");
+        return 1;
+    }
+    if (!compressed[0] || !compressed[1] || !compressed[2])
+        return 1;
+
+    /******************
+     * Ramdisk patches
+     ******************/
+
+    auto cpio = rust::patch_ramdisk(boot.map, parts.ramdisk.data, magiskinit,
+                                    magisk32, magisk64, stub);
+    if (cpio.empty()) {
+        fprintf(stderr, "! Unable to patch ramdisk\n");
+        return 1;
+    }
+    parts.ramdisk.set(byte_view(cpio.data(), cpio.size()));
+
+    /*****************
+     * Binary patches
+     *****************/
+
+    for (auto [name, part] : {
+            pair(DTB_FILE, &parts.dtb),
+            pair(KER_DTB_FILE, &parts.kernel_dtb),
+            pair(EXTRA_FILE, &parts.extra) }) {
+        if (!part->exists)
+            continue;
+        auto dtb = part->writable();
+        auto index = fdt_index(dtb);
+        if (!dtb_test(dtb, index)) {
+            fprintf(stderr, "! Boot image %s was patched by old (unsupported) Magisk\n", name);
+            fprintf(stderr, "! Please try again with *unpatched* boot image\n");
+            return 1;
+        }
+        if (dtb_patch(name, dtb, index))
+            fprintf(stderr, "- Patch fstab in boot image %s\n", name);
+    }
+
+    if (parts.kernel.exists) {
+        auto kernel = parts.kernel.writable();
+        bool patched = false;
+
+        // Remove Samsung RKP
+        patched |= hexpatch_buf(kernel,
+                byte_view("49010054011440B93FA00F71E9000054010840B93FA00F7189000054001840B91FA00F7188010054"),
+                byte_view("A1020054011440B93FA00F7140020054010840B93FA00F71E0010054001840B91FA00F7181010054"));
+
+        // Remove Samsung defex
+        // Before: [mov w2, #-221]   (-__NR_execve)
+        // After:  [mov w2, #-32768]
+        patched |= hexpatch_buf(kernel, byte_view("821B8012"), byte_view("E2FF8F12"));
+
+        // Force kernel to load rootfs for legacy SAR devices
+        // skip_initramfs -> want_initramfs
+        if (check_env("SYSTEM_ROOT")) {
+            patched |= hexpatch_buf(kernel,
+                    byte_view("736B69705F696E697472616D667300"),
+                    byte_view("77616E745F696E697472616D667300"));
+        }
+
+        // If the kernel doesn't need to be patched at all,
+        // keep raw kernel to avoid bootloops on some weird devices
+        if (!patched)
+            parts.kernel = {};
+    }
+
+    /*********
+     * Repack
+     *********/
+
+    fprintf(stderr, "- Repacking boot image\n");
+    repack_opts opts;
+    opts.cache_dir = getenv("REPACKCACHEDIR");
+    opts.threads = threads;
+    if (!repack(boot, parts, out_img, opts))
+        return 1;
+
+    return chromeos ? 2 : 0;
+}
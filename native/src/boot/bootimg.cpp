@@ -1,33 +1,273 @@
+#include <algorithm>
+#include <chrono>
+#include <string>
 #include <functional>
 #include <memory>
 
-#include <libfdt.h>
 #include <base.hpp>
 
 #include "boot-rs.hpp"
 #include "bootimg.hpp"
 #include "magiskboot.hpp"
 #include "compress.hpp"
+#include "parallel.hpp"
 
 using namespace std;
 
 #define PADDING 15
-#define SHA256_DIGEST_SIZE 32
-#define SHA_DIGEST_SIZE 20
 
 static void decompress(format_t type, int fd, const void *in, size_t size) {
-    auto ptr = get_decoder(type, make_unique<fd_channel>(fd));
-    ptr->write(in, size);
+    decompress(type, byte_view(in, size), fd);
 }
 
-static off_t compress(format_t type, int fd, const void *in, size_t size) {
-    auto prev = lseek(fd, 0, SEEK_CUR);
+// Compressed components are cached as <dir>/<sha256 of the input>-<format>-<level>,
+// followed by the encoder options that change the output. The number of threads is
+// not part of the key, as none of the encoders' output depends on it.
+static string cache_path(const char *dir, byte_view in, format_t type,
+                         const encoder_opts &opts) {
+    uint8_t sha[SHA256_DIGEST_SIZE];
+    sha256_hash(in, byte_data(sha, sizeof(sha)));
+    string path(dir);
+    path += '/';
+    char hex[3];
+    for (uint8_t b : sha) {
+        ssprintf(hex, sizeof(hex), "%02x", b);
+        path += hex;
+    }
+    path += '-';
+    path += fmt2name[type];
+    path += '-';
+    path += to_string(opts.level);
+    if (opts.blocks) {
+        // Block-parallel encoders, 0 is the default block size of the format
+        path += "-b";
+        path += to_string(opts.block_size);
+    }
+    if (opts.strategy >= 0) {
+        path += "-s";
+        path += to_string(opts.strategy);
+    }
+    if (opts.window) {
+        path += "-w";
+        path += to_string(opts.window);
+    }
+    return path;
+}
+
+// Compress into memory, reusing the output of a previous run from cache_dir if possible.
+// If cached is not null, it is set to whether the output was taken from the cache.
+static bool compress(format_t type, byte_view in, heap_data &out,
+                     const encoder_opts &opts, const char *cache_dir, bool *cached = nullptr) {
+    string path;
+    if (cached)
+        *cached = false;
+    if (cache_dir) {
+        path = cache_path(cache_dir, in, type, opts);
+        if (int fd = open(path.data(), O_RDONLY | O_CLOEXEC); fd >= 0) {
+            size_t size = lseek(fd, 0, SEEK_END);
+            out = heap_data(size);
+            bool hit = pread(fd, out.buf(), size, 0) == (ssize_t) size;
+            close(fd);
+            if (hit) {
+                if (cached)
+                    *cached = true;
+                return true;
+            }
+        }
+    }
+
+    out = heap_data(0);
     {
-        auto strm = get_encoder(type, make_unique<fd_channel>(fd));
-        strm->write(in, size);
+        auto strm = get_encoder(type, make_unique<byte_channel>(out), opts);
+        if (!strm->write(in.buf(), in.sz()))
+            return false;
+    }
+
+    if (cache_dir) {
+        // Write to a unique temporary file first, so that concurrent runs and other
+        // threads of this process never see or clobber partial entries
+        mkdirs(cache_dir, 0755);
+        string tmp = path + ".XXXXXX";
+        if (int fd = mkostemp(tmp.data(), O_CLOEXEC); fd >= 0) {
+            bool ok = fchmod(fd, 0644) == 0 &&
+                      xwrite(fd, out.buf(), out.sz()) == (ssize_t) out.sz();
+            close(fd);
+            if (!ok || rename(tmp.data(), path.data()) != 0)
+                unlink(tmp.data());
+        }
     }
-    auto now = lseek(fd, 0, SEEK_CUR);
-    return now - prev;
+    return true;
+}
+
+struct comp_candidate {
+    format_t fmt;
+    int level;
+    heap_data out;
+    double secs = 0;
+    bool ok = false;
+    bool cached = false;
+};
+
+// Formats from the fastest to the slowest to compress and decompress, used to rank the
+// candidates for comp_select::FIT. Within a format, lower levels are faster.
+static int speed_rank(format_t fmt) {
+    switch (fmt) {
+    case LZ4:
+    case LZ4_LEGACY:
+    case LZ4_LG:
+        return 0;
+    case GZIP:
+        return 1;
+    case BZIP2:
+        return 2;
+    case XZ:
+    case LZMA:
+        return 3;
+    case ZOPFLI:
+        return 4;
+    default:
+        return 5;
+    }
+}
+
+// Formats that produce streams the same decompressor can handle, from the fastest
+// to the strongest setting. LZ4 levels are LZ4HC levels.
+static void add_candidates(vector<comp_candidate> &list, format_t fmt) {
+    auto add = [&](format_t f, int level) {
+        for (auto &c : list) {
+            if (c.fmt == f && c.level == level)
+                return;
+        }
+        list.push_back({ f, level, heap_data(0) });
+    };
+    switch (fmt) {
+    case GZIP:
+    case ZOPFLI:
+        add(GZIP, 6);
+        add(GZIP, 9);
+        add(ZOPFLI, -1);
+        break;
+    case XZ:
+    case LZMA:
+        add(fmt, 6);
+        add(fmt, 9);
+        break;
+    case LZ4:
+    case LZ4_LEGACY:
+    case LZ4_LG:
+        add(fmt, 9);
+        add(fmt, 12);
+        break;
+    default:
+        add(fmt, -1);
+        break;
+    }
+}
+
+// Compress the component with every candidate in parallel. Failed candidates are dropped,
+// and the others are returned from the fastest to the slowest according to speed_rank.
+// The list is empty if every candidate failed.
+static vector<comp_candidate> compress_candidates(
+        const char *name, format_t fmt, byte_view in, const repack_opts &opts,
+        bool same_family, int threads) {
+    vector<comp_candidate> list;
+    add_candidates(list, fmt);
+    if (!same_family) {
+        for (format_t f : opts.formats)
+            add_candidates(list, f);
+    }
+
+    // Split threads between candidates instead of oversubscribing the CPU
+    encoder_opts eopts;
+    eopts.threads = std::max<int>(1, threads / list.size());
+    parallel_for(list.size(), [&](size_t i) {
+        auto &c = list[i];
+        auto start = chrono::steady_clock::now();
+        encoder_opts o = eopts;
+        o.level = c.level;
+        c.ok = compress(c.fmt, in, c.out, o, opts.cache_dir, &c.cached);
+        c.secs = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    });
+
+    for (auto &c : list) {
+        if (!c.ok)
+            continue;
+        if (c.cached) {
+            fprintf(stderr, "%s candidate: [%s] level %d, %zu bytes, cached\n",
+                    name, fmt2name[c.fmt], c.level, c.out.sz());
+        } else {
+            fprintf(stderr, "%s candidate: [%s] level %d, %zu bytes, %.2fs\n",
+                    name, fmt2name[c.fmt], c.level, c.out.sz(), c.secs);
+        }
+    }
+    list.erase(remove_if(list.begin(), list.end(),
+                         [](const comp_candidate &c) { return !c.ok; }), list.end());
+
+    // Rank by format and level rather than by the measured time, which is skewed by
+    // cache hits and by the other candidates running at the same time, and would make
+    // the choice, and thus the output image, differ from run to run
+    auto level = [](const comp_candidate &c) { return c.level < 0 ? INT_MAX : c.level; };
+    stable_sort(list.begin(), list.end(), [&](const comp_candidate &a, const comp_candidate &b) {
+        return pair(speed_rank(a.fmt), level(a)) < pair(speed_rank(b.fmt), level(b));
+    });
+    return list;
+}
+
+// Size of the image repack writes, if the kernel, ramdisk and extra it writes have these
+// sizes. This follows the layout of the blocks written by repack, page alignment included.
+static uint64_t image_size(const boot_img &boot, const boot_parts &parts,
+                           size_t kernel, size_t ramdisk, size_t extra) {
+    uint64_t page = boot.hdr->page_size();
+    uint64_t pos = 0;
+    if (boot.flags[DHTB_FLAG])
+        pos = sizeof(dhtb_hdr);
+    else if (boot.flags[BLOB_FLAG])
+        pos = sizeof(blob_hdr);
+    else if (boot.flags[NOOKHD_FLAG])
+        pos = NOOKHD_PRE_HEADER_SZ;
+    else if (boot.flags[ACCLAIM_FLAG])
+        pos = ACCLAIM_PRE_HEADER_SZ;
+    uint64_t header = pos;
+    auto align = [&](uint64_t n) { pos = header + align_to(pos - header, n); };
+    auto add = [&](const boot_part &part, size_t sz) {
+        if (part.exists) {
+            pos += sz;
+            align(page);
+        }
+    };
+    pos += boot.hdr->hdr_space();
+
+    // A zImage always keeps its original size
+    bool zimage = boot.flags[ZIMAGE_KERNEL];
+    pos += parts.kernel.exists && !zimage ? kernel : boot.hdr->kernel_size();
+    if (zimage)
+        pos += boot.z_info.hdr_sz + boot.z_info.tail.sz();
+    if (parts.kernel_dtb.exists)
+        pos += parts.kernel_dtb.data.sz();
+    if (boot.flags[MTK_KERNEL])
+        pos += sizeof(mtk_hdr);
+    align(page);
+
+    if (boot.flags[MTK_RAMDISK])
+        pos += sizeof(mtk_hdr);
+    add(parts.ramdisk, ramdisk);
+    add(parts.second, parts.second.data.sz());
+    add(parts.extra, extra);
+    add(parts.recovery_dtbo, parts.recovery_dtbo.data.sz());
+    add(parts.dtb, parts.dtb.data.sz());
+
+    pos += boot.ignore.sz();
+    if (boot.flags[SEANDROID_FLAG])
+        pos += 16 + (boot.flags[DHTB_FLAG] ? 4 : 0);
+    else if (boot.flags[LG_BUMP_FLAG])
+        pos += 16;
+    align(page);
+
+    if (boot.flags[AVB_FLAG]) {
+        align(4096);
+        pos += __builtin_bswap64(boot.avb_footer->vbmeta_size) + sizeof(AvbFooter);
+    }
+    return pos;
 }
 
 static void dump(const void *buf, size_t size, const char *filename) {
@@ -38,14 +278,22 @@ static void dump(const void *buf, size_t size, const char *filename) {
     close(fd);
 }
 
-static size_t restore(int fd, const char *filename) {
-    int ifd = xopen(filename, O_RDONLY);
-    size_t size = lseek(ifd, 0, SEEK_END);
-    lseek(ifd, 0, SEEK_SET);
-    xsendfile(fd, ifd, nullptr, size);
-    close(ifd);
-    return size;
-}
+// Feeds everything written through it into a hash context, if any
+class sha_tee_stream : public filter_out_stream {
+public:
+    sha_tee_stream(out_strm_ptr &&base, SHA *ctx) : filter_out_stream(std::move(base)), ctx(ctx) {}
+    bool write(const void *buf, size_t len) override {
+        if (ctx)
+            ctx->update(byte_view(buf, len));
+        return filter_out_stream::write(buf, len);
+    }
+    void update_size(uint32_t size) {
+        if (ctx)
+            ctx->update(byte_view(&size, sizeof(size)));
+    }
+
+    SHA *ctx;
+};
 
 void dyn_img_hdr::print() const {
     uint32_t ver = header_version();
@@ -91,8 +339,8 @@ void dyn_img_hdr::print() const {
     }
 }
 
-void dyn_img_hdr::dump_hdr_file() const {
-    FILE *fp = xfopen(HEADER_FILE, "w");
+void dyn_img_hdr::dump_hdr_file(const char *file) const {
+    FILE *fp = xfopen(file, "w");
     if (name())
         fprintf(fp, "name=%s\n", name());
     fprintf(fp, "cmdline=%.*s%.*s\n", BOOT_ARGS_SIZE, cmdline(), BOOT_EXTRA_ARGS_SIZE, extra_cmdline());
@@ -115,8 +363,8 @@ void dyn_img_hdr::dump_hdr_file() const {
     fclose(fp);
 }
 
-void dyn_img_hdr::load_hdr_file() {
-    parse_prop_file(HEADER_FILE, [=, this](string_view key, string_view value) -> bool {
+void dyn_img_hdr::load_hdr_file(const char *file) {
+    parse_prop_file(file, [=, this](string_view key, string_view value) -> bool {
         if (key == "name" && name()) {
             memset(name(), 0, 16);
             memcpy(name(), value.data(), value.length() > 15 ? 15 : value.length());
@@ -146,10 +394,41 @@ void dyn_img_hdr::load_hdr_file() {
     });
 }
 
-boot_img::boot_img(const char *image) : map(image) {
+// In hdr_only mode, headers are only searched within this many leading bytes
+#define HDR_SCAN_SZ (1024 * 1024)
+// ... and only this many leading bytes are readable, enough for any pre-header
+#define HDR_WINDOW_SZ (HDR_SCAN_SZ + NOOKHD_PRE_HEADER_SZ + 0x10000)
+
+// Make the pages covering [addr, addr + len) of a PROT_NONE mapping readable
+static void expose_range(const mmap_data &map, const uint8_t *addr, size_t len) {
+    size_t page = getpagesize();
+    size_t start = (addr - map.buf()) / page * page;
+    size_t end = std::min(align_to(addr - map.buf() + len, page), align_to(map.sz(), page));
+    mprotect(const_cast<uint8_t *>(map.buf()) + start, end - start, PROT_READ);
+}
+
+boot_img::boot_img(const char *image, bool exit_on_error, bool hdr_only)
+        : map(image), hdr_only(hdr_only) {
     fprintf(stderr, "Parsing boot image: [%s]\n", image);
-    for (const uint8_t *addr = map.buf(); addr < map.buf() + map.sz(); ++addr) {
-        format_t fmt = check_fmt(addr, map.sz());
+    size_t scan_sz = map.sz();
+    if (hdr_only && map.sz()) {
+        // Only the header window and the start of the tail are readable, any stray
+        // access to block data faults instead of silently paging it in
+        fd = xopen(image, O_RDONLY | O_CLOEXEC);
+        madvise(const_cast<uint8_t *>(map.buf()), map.sz(), MADV_RANDOM);
+        mprotect(const_cast<uint8_t *>(map.buf()), map.sz(), PROT_NONE);
+        expose_range(map, map.buf(), HDR_WINDOW_SZ);
+        scan_sz = std::min<size_t>(scan_sz, HDR_SCAN_SZ);
+    }
+    // Only these formats are handled below, so skip straight to offsets that start
+    // with the first byte of one of their magics
+    const char first_bytes[] = {
+        CHROMEOS_MAGIC[0], DHTB_MAGIC[0], TEGRABLOB_MAGIC[0], BOOT_MAGIC[0], VENDOR_BOOT_MAGIC[0]
+    };
+    const uint8_t *end = map.buf() + std::min<size_t>(map.sz(), hdr_only ? HDR_WINDOW_SZ : map.sz());
+    magic_scanner scanner(map.buf(), scan_sz, string_view(first_bytes, sizeof(first_bytes)));
+    for (const uint8_t *addr = scanner.next(map.buf()); addr; addr = scanner.next(addr + 1)) {
+        format_t fmt = check_fmt(addr, end - addr);
         switch (fmt) {
         case CHROMEOS:
             // chromeos require external signing
@@ -176,41 +455,19 @@ boot_img::boot_img(const char *image) : map(image) {
             break;
         }
     }
-    exit(1);
+    if (exit_on_error)
+        exit(1);
 }
 
 boot_img::~boot_img() {
     delete hdr;
+    if (fd >= 0)
+        close(fd);
 }
 
 static int find_dtb_offset(const uint8_t *buf, unsigned sz) {
-    const uint8_t * const end = buf + sz;
-
-    for (auto curr = buf; curr < end; curr += sizeof(fdt_header)) {
-        curr = static_cast<uint8_t*>(memmem(curr, end - curr, DTB_MAGIC, sizeof(fdt32_t)));
-        if (curr == nullptr)
-            return -1;
-
-        auto fdt_hdr = reinterpret_cast<const fdt_header *>(curr);
-
-        // Check that fdt_header.totalsize does not overflow kernel image size
-        uint32_t totalsize = fdt32_to_cpu(fdt_hdr->totalsize);
-        if (totalsize > end - curr)
-            continue;
-
-        // Check that fdt_header.off_dt_struct does not overflow kernel image size
-        uint32_t off_dt_struct = fdt32_to_cpu(fdt_hdr->off_dt_struct);
-        if (off_dt_struct > end - curr)
-            continue;
-
-        // Check that fdt_node_header.tag of first node is FDT_BEGIN_NODE
-        auto fdt_node_hdr = reinterpret_cast<const fdt_node_header *>(curr + off_dt_struct);
-        if (fdt32_to_cpu(fdt_node_hdr->tag) != FDT_BEGIN_NODE)
-            continue;
-
-        return curr - buf;
-    }
-    return -1;
+    auto index = fdt_index(byte_view(buf, sz), 1);
+    return index.empty() ? -1 : index[0];
 }
 
 static format_t check_fmt_lg(const uint8_t *buf, unsigned sz) {
@@ -364,8 +621,10 @@ bool boot_img::parse_image(const uint8_t *p, format_t type) {
     auto tail_addr = base_addr + off;
     ignore = byte_view(ignore_addr, tail_addr - ignore_addr);
     tail = byte_view(tail_addr, map.buf() + map.sz() - tail_addr);
+    if (hdr_only && tail.sz() >= 16)
+        expose_range(map, tail.buf(), 16);
 
-    if (auto size = hdr->kernel_size()) {
+    if (auto size = hdr->kernel_size(); size && !hdr_only) {
         if (int dtb_off = find_dtb_offset(kernel, size); dtb_off > 0) {
             kernel_dtb = byte_view(kernel + dtb_off, size - dtb_off);
             hdr->kernel_size() = dtb_off;
@@ -416,7 +675,7 @@ bool boot_img::parse_image(const uint8_t *p, format_t type) {
         }
         fprintf(stderr, "%-*s [%s]\n", PADDING, "KERNEL_FMT", fmt2name[k_fmt]);
     }
-    if (auto size = hdr->ramdisk_size()) {
+    if (auto size = hdr->ramdisk_size(); size && !hdr_only) {
         if (hdr->is_vendor() && hdr->header_version() >= 4) {
             // v4 vendor boot contains multiple ramdisks
             // Do not try to mess with it for now
@@ -436,7 +695,7 @@ bool boot_img::parse_image(const uint8_t *p, format_t type) {
         }
         fprintf(stderr, "%-*s [%s]\n", PADDING, "RAMDISK_FMT", fmt2name[r_fmt]);
     }
-    if (auto size = hdr->extra_size()) {
+    if (auto size = hdr->extra_size(); size && !hdr_only) {
         e_fmt = check_fmt_lg(extra, size);
         fprintf(stderr, "%-*s [%s]\n", PADDING, "EXTRA_FMT", fmt2name[e_fmt]);
     }
@@ -451,22 +710,38 @@ bool boot_img::parse_image(const uint8_t *p, format_t type) {
             flags[LG_BUMP_FLAG] = true;
         }
 
-        // Check if the image is signed
-        if (verify()) {
+        // Check if the image is signed, which hashes the whole payload
+        if (!hdr_only && verify()) {
             fprintf(stderr, "AVB1_SIGNED\n");
             flags[AVB1_SIGNED_FLAG] = true;
         }
 
         // Find AVB footer
         const void *footer = tail.buf() + tail.sz() - sizeof(AvbFooter);
-        if (BUFFER_MATCH(footer, AVB_FOOTER_MAGIC)) {
+        if (hdr_only) {
+            // The end of the tail is not readable, pread a copy of the footer
+            footer = nullptr;
+            if (tail.sz() >= sizeof(AvbFooter) &&
+                pread(fd, &footer_copy, sizeof(AvbFooter), map.sz() - sizeof(AvbFooter)) ==
+                sizeof(AvbFooter))
+                footer = &footer_copy;
+        }
+        if (footer && BUFFER_MATCH(footer, AVB_FOOTER_MAGIC)) {
             avb_footer = reinterpret_cast<const AvbFooter*>(footer);
             // Double check if meta header exists
-            const void *meta = base_addr + __builtin_bswap64(avb_footer->vbmeta_offset);
-            if (BUFFER_MATCH(meta, AVB_MAGIC)) {
+            uint64_t meta_off = base_addr - map.buf() +
+                                __builtin_bswap64(avb_footer->vbmeta_offset);
+            uint8_t magic[AVB_MAGIC_LEN] = {};
+            if (meta_off <= map.sz() - AVB_MAGIC_LEN) {
+                if (!hdr_only)
+                    memcpy(magic, map.buf() + meta_off, sizeof(magic));
+                else if (pread(fd, magic, sizeof(magic), meta_off) != sizeof(magic))
+                    magic[0] = 0;
+            }
+            if (BUFFER_MATCH(magic, AVB_MAGIC)) {
                 fprintf(stderr, "VBMETA\n");
                 flags[AVB_FLAG] = true;
-                vbmeta = reinterpret_cast<const AvbVBMetaImageHeader*>(meta);
+                vbmeta = reinterpret_cast<const AvbVBMetaImageHeader*>(map.buf() + meta_off);
             }
         }
     }
@@ -479,13 +754,35 @@ bool boot_img::verify(const char *cert) const {
     return rust::verify_boot_image(*this, cert);
 }
 
+// Name of the partition the image is flashed to, as used in its AVB hash descriptor
+static const char *avb_partition_name(const boot_img &boot) {
+    if (boot.hdr->is_vendor())
+        return "vendor_boot";
+    // init_boot images are v4 boot images without a kernel
+    if (boot.hdr->header_version() >= 4 && boot.hdr->kernel_size() == 0)
+        return "init_boot";
+    return "boot";
+}
+
+bool boot_img::verify_avb() const {
+    if (!flags[AVB_FLAG])
+        return false;
+    uint64_t image_sz = __builtin_bswap64(avb_footer->original_image_size);
+    uint64_t vbmeta_sz = __builtin_bswap64(avb_footer->vbmeta_size);
+    auto meta = reinterpret_cast<const uint8_t *>(vbmeta);
+    if (image_sz > map.sz() || vbmeta_sz > map.sz() - (meta - map.buf()))
+        return false;
+    return verify_avb_hashes(byte_view(map.buf(), image_sz), byte_view(meta, vbmeta_sz),
+                             avb_partition_name(*this));
+}
+
 int split_image_dtb(const char *filename) {
     mmap_data img(filename);
 
     if (int off = find_dtb_offset(img.buf(), img.sz()); off > 0) {
         format_t fmt = check_fmt_lg(img.buf(), img.sz());
         if (COMPRESSED(fmt)) {
-            int fd = creat(KERNEL_FILE, 0644);
+            int fd = xopen(KERNEL_FILE, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
             decompress(fmt, fd, img.buf(), off);
             close(fd);
         } else {
@@ -503,72 +800,194 @@ int unpack(const char *image, bool skip_decomp, bool hdr) {
     const boot_img boot(image);
 
     if (hdr)
-        boot.hdr->dump_hdr_file();
+        boot.hdr->dump_hdr_file(HEADER_FILE);
+
+    // Every component goes to its own file, so they are all written concurrently
+    vector<function<void()>> tasks;
 
     // Dump kernel
-    if (!skip_decomp && COMPRESSED(boot.k_fmt)) {
-        if (boot.hdr->kernel_size() != 0) {
-            int fd = creat(KERNEL_FILE, 0644);
-            decompress(boot.k_fmt, fd, boot.kernel, boot.hdr->kernel_size());
-            close(fd);
+    tasks.emplace_back([&] {
+        if (!skip_decomp && COMPRESSED(boot.k_fmt)) {
+            if (boot.hdr->kernel_size() != 0) {
+                int fd = xopen(KERNEL_FILE, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+                decompress(boot.k_fmt, fd, boot.kernel, boot.hdr->kernel_size());
+                close(fd);
+            }
+        } else {
+            dump(boot.kernel, boot.hdr->kernel_size(), KERNEL_FILE);
         }
-    } else {
-        dump(boot.kernel, boot.hdr->kernel_size(), KERNEL_FILE);
-    }
+    });
 
     // Dump kernel_dtb
-    dump(boot.kernel_dtb.buf(), boot.kernel_dtb.sz(), KER_DTB_FILE);
+    tasks.emplace_back([&] {
+        dump(boot.kernel_dtb.buf(), boot.kernel_dtb.sz(), KER_DTB_FILE);
+    });
 
     // Dump ramdisk
-    if (!skip_decomp && COMPRESSED(boot.r_fmt)) {
-        if (boot.hdr->ramdisk_size() != 0) {
-            int fd = creat(RAMDISK_FILE, 0644);
-            decompress(boot.r_fmt, fd, boot.ramdisk, boot.hdr->ramdisk_size());
-            close(fd);
+    tasks.emplace_back([&] {
+        if (!skip_decomp && COMPRESSED(boot.r_fmt)) {
+            if (boot.hdr->ramdisk_size() != 0) {
+                int fd = xopen(RAMDISK_FILE, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+                decompress(boot.r_fmt, fd, boot.ramdisk, boot.hdr->ramdisk_size());
+                close(fd);
+            }
+        } else {
+            dump(boot.ramdisk, boot.hdr->ramdisk_size(), RAMDISK_FILE);
         }
-    } else {
-        dump(boot.ramdisk, boot.hdr->ramdisk_size(), RAMDISK_FILE);
-    }
+    });
 
     // Dump second
-    dump(boot.second, boot.hdr->second_size(), SECOND_FILE);
+    tasks.emplace_back([&] {
+        dump(boot.second, boot.hdr->second_size(), SECOND_FILE);
+    });
 
     // Dump extra
-    if (!skip_decomp && COMPRESSED(boot.e_fmt)) {
-        if (boot.hdr->extra_size() != 0) {
-            int fd = creat(EXTRA_FILE, 0644);
-            decompress(boot.e_fmt, fd, boot.extra, boot.hdr->extra_size());
-            close(fd);
+    tasks.emplace_back([&] {
+        if (!skip_decomp && COMPRESSED(boot.e_fmt)) {
+            if (boot.hdr->extra_size() != 0) {
+                int fd = xopen(EXTRA_FILE, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+                decompress(boot.e_fmt, fd, boot.extra, boot.hdr->extra_size());
+                close(fd);
+            }
+        } else {
+            dump(boot.extra, boot.hdr->extra_size(), EXTRA_FILE);
         }
-    } else {
-        dump(boot.extra, boot.hdr->extra_size(), EXTRA_FILE);
-    }
+    });
 
     // Dump recovery_dtbo
-    dump(boot.recovery_dtbo, boot.hdr->recovery_dtbo_size(), RECV_DTBO_FILE);
+    tasks.emplace_back([&] {
+        dump(boot.recovery_dtbo, boot.hdr->recovery_dtbo_size(), RECV_DTBO_FILE);
+    });
 
     // Dump dtb
-    dump(boot.dtb, boot.hdr->dtb_size(), DTB_FILE);
+    tasks.emplace_back([&] {
+        dump(boot.dtb, boot.hdr->dtb_size(), DTB_FILE);
+    });
+
+    parallel_for(tasks.size(), [&](size_t i) { tasks[i](); });
 
     return boot.flags[CHROMEOS_FLAG] ? 2 : 0;
 }
 
+// Decompress a component into memory, or reference it as is if it is not compressed.
+// If decompression fails, the part holds whatever was decoded before the error.
+static bool unpack_part(const char *name, boot_part &part, format_t fmt, const uint8_t *buf,
+                        size_t sz, int threads) {
+    if (sz == 0)
+        return true;
+    if (!COMPRESSED(fmt)) {
+        part.set(byte_view(buf, sz));
+        return true;
+    }
+    heap_data out;
+    bool ok = decompress(fmt, byte_view(buf, sz), make_unique<byte_channel>(out), threads);
+    if (!ok)
+        LOGW("Failed to decompress %s\n", name);
+    part.set(std::move(out));
+    return ok;
+}
+
+bool unpack(const boot_img &boot, boot_parts &parts, int threads) {
+    if (threads <= 0)
+        threads = max_threads();
+    vector<function<void()>> tasks;
+    // Each flag is only written by its own task
+    bool k_ok = true, r_ok = true, e_ok = true;
+
+    tasks.emplace_back([&] {
+        k_ok = unpack_part("kernel", parts.kernel, boot.k_fmt, boot.kernel,
+                           boot.hdr->kernel_size(), threads);
+    });
+    tasks.emplace_back([&] {
+        if (boot.kernel_dtb.sz())
+            parts.kernel_dtb.set(boot.kernel_dtb);
+    });
+    tasks.emplace_back([&] {
+        r_ok = unpack_part("ramdisk", parts.ramdisk, boot.r_fmt, boot.ramdisk,
+                           boot.hdr->ramdisk_size(), threads);
+    });
+    tasks.emplace_back([&] {
+        e_ok = unpack_part("extra", parts.extra, boot.e_fmt, boot.extra,
+                           boot.hdr->extra_size(), threads);
+    });
+    parallel_for(tasks.size(), [&](size_t i) { tasks[i](); }, threads);
+
+    if (boot.hdr->second_size())
+        parts.second.set(byte_view(boot.second, boot.hdr->second_size()));
+    if (boot.hdr->recovery_dtbo_size())
+        parts.recovery_dtbo.set(byte_view(boot.recovery_dtbo, boot.hdr->recovery_dtbo_size()));
+    if (boot.hdr->dtb_size())
+        parts.dtb.set(byte_view(boot.dtb, boot.hdr->dtb_size()));
+    return k_ok && r_ok && e_ok;
+}
+
 #define file_align_with(page_size) \
-write_zero(fd, align_padding(lseek(fd, 0, SEEK_CUR) - off.header, page_size))
+write_hole(fd, align_padding(lseek(fd, 0, SEEK_CUR) - off.header, page_size))
 
 #define file_align() file_align_with(boot.hdr->page_size())
 
-void repack(const char *src_img, const char *out_img, bool skip_comp) {
+static void load_part(int dirfd, boot_part &part, const char *file) {
+    int fd = openat(dirfd, file, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return;
+    if (size_t sz = lseek(fd, 0, SEEK_END))
+        part.set(mmap_data(fd, sz));
+    else
+        part.set(byte_view());
+    close(fd);
+}
+
+void load_parts(int dirfd, boot_parts &parts) {
+    load_part(dirfd, parts.kernel, KERNEL_FILE);
+    load_part(dirfd, parts.kernel_dtb, KER_DTB_FILE);
+    load_part(dirfd, parts.ramdisk, RAMDISK_FILE);
+    load_part(dirfd, parts.second, SECOND_FILE);
+    load_part(dirfd, parts.extra, EXTRA_FILE);
+    load_part(dirfd, parts.recovery_dtbo, RECV_DTBO_FILE);
+    load_part(dirfd, parts.dtb, DTB_FILE);
+}
+
+static bool dump_part(int dirfd, const boot_part &part, const char *file) {
+    if (part.data.sz() == 0)
+        return true;
+    int fd = xopenat(dirfd, file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return false;
+    bool ok = xwrite(fd, part.data.buf(), part.data.sz()) == static_cast<ssize_t>(part.data.sz());
+    close(fd);
+    return ok;
+}
+
+bool dump_parts(int dirfd, const boot_parts &parts) {
+    bool ok = true;
+    ok &= dump_part(dirfd, parts.kernel, KERNEL_FILE);
+    ok &= dump_part(dirfd, parts.kernel_dtb, KER_DTB_FILE);
+    ok &= dump_part(dirfd, parts.ramdisk, RAMDISK_FILE);
+    ok &= dump_part(dirfd, parts.second, SECOND_FILE);
+    ok &= dump_part(dirfd, parts.extra, EXTRA_FILE);
+    ok &= dump_part(dirfd, parts.recovery_dtbo, RECV_DTBO_FILE);
+    ok &= dump_part(dirfd, parts.dtb, DTB_FILE);
+    return ok;
+}
+
+void repack(const char *src_img, const char *out_img, const repack_opts &opts) {
     const boot_img boot(src_img);
+    boot_parts parts;
+    load_parts(AT_FDCWD, parts);
+    if (access(HEADER_FILE, R_OK) == 0)
+        parts.header_file = HEADER_FILE;
+    repack(boot, parts, out_img, opts);
+}
+
+bool repack(const boot_img &boot, const boot_parts &parts, const char *out_img,
+            const repack_opts &opts) {
+    bool skip_comp = opts.skip_comp;
+    bool auto_comp = opts.select != comp_select::ORIGINAL;
+    int threads = opts.threads > 0 ? opts.threads : max_threads();
     fprintf(stderr, "Repack to boot image: [%s]\n", out_img);
 
     struct {
         uint32_t header;
-        uint32_t kernel;
-        uint32_t ramdisk;
-        uint32_t second;
-        uint32_t extra;
-        uint32_t dtb;
         uint32_t total;
         uint32_t vbmeta;
     } off{};
@@ -580,8 +999,153 @@ void repack(const char *src_img, const char *out_img, bool skip_comp) {
     hdr->second_size() = 0;
     hdr->dtb_size() = 0;
 
-    if (access(HEADER_FILE, R_OK) == 0)
-        hdr->load_hdr_file();
+    if (parts.header_file)
+        hdr->load_hdr_file(parts.header_file);
+
+    /**************************
+     * Compress the components
+     **************************/
+
+    bool zimage = boot.flags[ZIMAGE_KERNEL];
+    // Always use zopfli for zImage compression
+    auto k_fmt = (!auto_comp && zimage && boot.k_fmt == GZIP) ? ZOPFLI : boot.k_fmt;
+    auto r_fmt = boot.r_fmt;
+    if (!skip_comp && !hdr->is_vendor() && hdr->header_version() == 4 && r_fmt != LZ4_LEGACY
+        && parts.ramdisk.exists) {
+        // A v4 boot image ramdisk will have to be merged with other vendor ramdisks,
+        // and they have to use the exact same compression method. v4 GKIs are required to
+        // use lz4 (legacy), so hardcode the format here.
+        fprintf(stderr, "RAMDISK_FMT: [%s] -> [%s]\n", fmt2name[r_fmt], fmt2name[LZ4_LEGACY]);
+        r_fmt = LZ4_LEGACY;
+    }
+
+    struct component {
+        const char *name;
+        const boot_part &part;
+        format_t fmt;
+        // Space the component took in the original image, only used with comp_select::FIT
+        size_t budget;
+        // Whether the component has to fit in budget, without growing into free space
+        bool fixed;
+        // Whether only formats compatible with fmt can be used
+        bool same_family;
+
+        bool compress = false;
+        bool ok = true;
+        heap_data out;
+        // Successful candidates with auto_comp, from the fastest to the slowest
+        vector<comp_candidate> candidates;
+
+        bool exists() const { return part.exists; }
+        const byte_view &data() const { return part.data; }
+        byte_view result() const { return compress ? byte_view(out) : data(); }
+    } comps[] = {
+        // zImage decompressors only support the format they were built with, and
+        // the new payload has to fit in the zImage, leaving space for the uncompressed
+        // size at the end
+        { "KERNEL", parts.kernel, k_fmt,
+          boot.hdr->kernel_size() - (zimage ? sizeof(uint32_t) : 0), zimage, zimage },
+        // v4 ramdisks are concatenated with other ramdisks that use the same format
+        { "RAMDISK", parts.ramdisk, r_fmt,
+          boot.hdr->ramdisk_size(), false, hdr->header_version() == 4 },
+        { "EXTRA", parts.extra, boot.e_fmt,
+          boot.hdr->extra_size(), false, false },
+    };
+    auto &kernel = comps[0];
+    auto &ramdisk = comps[1];
+    auto &extra = comps[2];
+
+    for (auto &c : comps) {
+        c.compress = c.exists() && !skip_comp && COMPRESSED(c.fmt)
+                     && !COMPRESSED_ANY(check_fmt(c.data().buf(), c.data().sz()));
+    }
+
+    // The components are independent of each other, so compress them all concurrently
+    // into memory. The image layout and header fix-ups below only need the results.
+    // Split threads between the components instead of oversubscribing the CPU.
+    size_t active = std::count_if(std::begin(comps), std::end(comps),
+                                  [](const component &c) { return c.compress; });
+    int comp_threads = std::max<int>(1, threads / std::max<size_t>(1, active));
+    encoder_opts eopts;
+    eopts.threads = comp_threads;
+    parallel_for(std::size(comps), [&](size_t i) {
+        auto &c = comps[i];
+        if (!c.compress)
+            return;
+        if (auto_comp) {
+            c.candidates = compress_candidates(c.name, c.fmt, c.data(), opts, c.same_family,
+                                               comp_threads);
+            c.ok = !c.candidates.empty();
+        } else {
+            c.ok = compress(c.fmt, c.data(), c.out, eopts, opts.cache_dir);
+        }
+    }, threads);
+    for (auto &c : comps) {
+        if (!c.ok) {
+            LOGE("Failed to compress %s\n", c.name);
+            return false;
+        }
+    }
+
+    // Choose one candidate for each component. SMALLEST and FIT start from the smallest
+    // candidates. FIT then switches every component, in order, to its fastest candidate
+    // that still fits, where the whole new image, laid out with every component of
+    // parts, has to fit in the original image.
+    if (auto_comp) {
+        vector<comp_candidate *> chosen(std::size(comps));
+        vector<size_t> sizes(std::size(comps));
+        for (size_t i = 0; i < std::size(comps); ++i) {
+            auto &c = comps[i];
+            for (auto &cand : c.candidates) {
+                if (!chosen[i] || cand.out.sz() < chosen[i]->out.sz())
+                    chosen[i] = &cand;
+            }
+            // Components that are not compressed here can have changed size as well
+            sizes[i] = chosen[i] ? chosen[i]->out.sz() : c.result().sz();
+        }
+        auto new_size = [&] { return image_size(boot, parts, sizes[0], sizes[1], sizes[2]); };
+
+        bool fit = opts.select == comp_select::FIT;
+        if (fit) {
+            // ChromeOS images are not padded to the original size, and the signature
+            // appended to AVB 1.0 signed images has an unknown size, so neither can grow
+            uint64_t limit = image_size(boot, parts, kernel.budget, ramdisk.budget, extra.budget);
+            if (!boot.flags[CHROMEOS_FLAG] && !boot.flags[AVB1_SIGNED_FLAG])
+                limit = std::max<uint64_t>(limit, boot.map.sz());
+            if (new_size() > limit) {
+                fprintf(stderr, "! Components do not fit in the original image, using the smallest\n");
+                fit = false;
+            }
+            for (size_t i = 0; fit && i < std::size(comps); ++i) {
+                auto &c = comps[i];
+                if (!chosen[i])
+                    continue;
+                if (c.fixed && chosen[i]->out.sz() > c.budget) {
+                    fprintf(stderr, "! No %s candidate fits in %zu bytes, using the smallest\n",
+                            c.name, c.budget);
+                    continue;
+                }
+                for (auto &cand : c.candidates) {
+                    sizes[i] = cand.out.sz();
+                    if (c.fixed ? cand.out.sz() <= c.budget : new_size() <= limit) {
+                        chosen[i] = &cand;
+                        break;
+                    }
+                }
+                sizes[i] = chosen[i]->out.sz();
+            }
+        }
+        for (size_t i = 0; i < std::size(comps); ++i) {
+            auto &c = comps[i];
+            if (!chosen[i])
+                continue;
+            fprintf(stderr, "%s_FMT: [%s] -> [%s] level %d, %zu bytes\n", c.name,
+                    fmt2name[c.fmt], fmt2name[chosen[i]->fmt], chosen[i]->level,
+                    chosen[i]->out.sz());
+            c.out = std::move(chosen[i]->out);
+            c.candidates.clear();
+        }
+    }
 
     /***************
      * Write blocks
@@ -589,144 +1153,178 @@ void repack(const char *src_img, const char *out_img, bool skip_comp) {
 
     // Create new image
     int fd = creat(out_img, 0644);
+    if (fd < 0) {
+        PLOGE("Create [%s]", out_img);
+        return false;
+    }
+
+    // Any failed write is only reported once the image is complete
+    bool io_ok = true;
+    auto write_raw = [&](const void *buf, size_t len) {
+        io_ok &= xwrite(fd, buf, len) == static_cast<ssize_t>(len);
+    };
 
     if (boot.flags[DHTB_FLAG]) {
         // Skip DHTB header
         write_zero(fd, sizeof(dhtb_hdr));
     } else if (boot.flags[BLOB_FLAG]) {
-        xwrite(fd, boot.map.buf(), sizeof(blob_hdr));
+        write_raw(boot.map.buf(), sizeof(blob_hdr));
     } else if (boot.flags[NOOKHD_FLAG]) {
-        xwrite(fd, boot.map.buf(), NOOKHD_PRE_HEADER_SZ);
+        write_raw(boot.map.buf(), NOOKHD_PRE_HEADER_SZ);
     } else if (boot.flags[ACCLAIM_FLAG]) {
-        xwrite(fd, boot.map.buf(), ACCLAIM_PRE_HEADER_SZ);
+        write_raw(boot.map.buf(), ACCLAIM_PRE_HEADER_SZ);
     }
 
     // Copy raw header
     off.header = lseek(fd, 0, SEEK_CUR);
-    xwrite(fd, boot.payload.buf(), hdr->hdr_space());
+    write_raw(boot.payload.buf(), hdr->hdr_space());
+
+    // The boot image id is a checksum over the components exactly as they are written,
+    // so hash them on their way to the file instead of reading the image back afterwards
+    auto id_ctx = get_sha(!boot.flags[SHA256_FLAG]);
+    SHA *id_sha = hdr->id() ? &*id_ctx : nullptr;
+    sha_tee_stream out_strm(make_unique<fd_channel>(fd), id_sha);
+    auto write_part = [&](const boot_part &part) -> size_t {
+        if (part.data.sz())
+            io_ok &= out_strm.write(part.data.buf(), part.data.sz());
+        return part.data.sz();
+    };
 
     // kernel
-    off.kernel = lseek(fd, 0, SEEK_CUR);
-    if (boot.flags[MTK_KERNEL]) {
-        // Copy MTK headers
-        xwrite(fd, boot.k_hdr, sizeof(mtk_hdr));
-    }
-    if (boot.flags[ZIMAGE_KERNEL]) {
-        // Copy zImage headers
-        xwrite(fd, boot.z_hdr, boot.z_info.hdr_sz);
-    }
-    if (access(KERNEL_FILE, R_OK) == 0) {
-        mmap_data m(KERNEL_FILE);
-        if (!skip_comp && !COMPRESSED_ANY(check_fmt(m.buf(), m.sz())) && COMPRESSED(boot.k_fmt)) {
-            // Always use zopfli for zImage compression
-            auto fmt = (boot.flags[ZIMAGE_KERNEL] && boot.k_fmt == GZIP) ? ZOPFLI : boot.k_fmt;
-            hdr->kernel_size() = compress(fmt, fd, m.buf(), m.sz());
-        } else {
-            hdr->kernel_size() = xwrite(fd, m.buf(), m.sz());
-        }
-
-        if (boot.flags[ZIMAGE_KERNEL]) {
-            if (hdr->kernel_size() > boot.hdr->kernel_size()) {
-                fprintf(stderr, "! Recompressed kernel is too large, using original kernel\n");
-                ftruncate64(fd, lseek64(fd, - (off64_t) hdr->kernel_size(), SEEK_CUR));
-                xwrite(fd, boot.kernel, boot.hdr->kernel_size());
-            } else if (!skip_comp) {
-                // Pad zeros to make sure the zImage file size does not change
-                // Also ensure the last 4 bytes are the uncompressed vmlinux size
-                uint32_t sz = m.sz();
-                write_zero(fd, boot.hdr->kernel_size() - hdr->kernel_size() - sizeof(sz));
-                xwrite(fd, &sz, sizeof(sz));
-            }
+    {
+        // Collect the whole kernel block first, so the MTK header is written with its final size
+        vector<byte_view> blocks;
+        heap_data z_pad;
+        if (zimage) {
+            // Copy zImage headers
+            blocks.emplace_back(boot.z_hdr, boot.z_info.hdr_sz);
+        }
+        if (kernel.exists()) {
+            byte_view k = kernel.result();
+            hdr->kernel_size() = k.sz();
+            if (zimage) {
+                // The uncompressed vmlinux size has to fit after the recompressed payload
+                size_t need = k.sz() + (skip_comp ? 0 : sizeof(uint32_t));
+                if (need > boot.hdr->kernel_size()) {
+                    fprintf(stderr, "! Recompressed kernel is too large, using original kernel\n");
+                    k = byte_view(boot.kernel, boot.hdr->kernel_size());
+                    blocks.push_back(k);
+                } else {
+                    blocks.push_back(k);
+                    if (!skip_comp) {
+                        // Pad zeros to make sure the zImage file size does not change
+                        // Also ensure the last 4 bytes are the uncompressed vmlinux size
+                        uint32_t sz = kernel.data().sz();
+                        z_pad = heap_data(boot.hdr->kernel_size() - k.sz());
+                        memcpy(z_pad.buf() + z_pad.sz() - sizeof(sz), &sz, sizeof(sz));
+                        blocks.push_back(z_pad);
+                    }
+                }
 
-            // zImage size shall remain the same
+                // zImage size shall remain the same
+                hdr->kernel_size() = boot.hdr->kernel_size();
+            } else {
+                blocks.push_back(k);
+            }
+        } else if (boot.hdr->kernel_size() != 0) {
+            blocks.emplace_back(boot.kernel, boot.hdr->kernel_size());
             hdr->kernel_size() = boot.hdr->kernel_size();
         }
-    } else if (boot.hdr->kernel_size() != 0) {
-        xwrite(fd, boot.kernel, boot.hdr->kernel_size());
-        hdr->kernel_size() = boot.hdr->kernel_size();
-    }
-    if (boot.flags[ZIMAGE_KERNEL]) {
-        // Copy zImage tail and adjust size accordingly
-        hdr->kernel_size() += boot.z_info.hdr_sz;
-        hdr->kernel_size() += xwrite(fd, boot.z_info.tail.buf(), boot.z_info.tail.sz());
-    }
+        if (zimage) {
+            // Copy zImage tail and adjust size accordingly
+            hdr->kernel_size() += boot.z_info.hdr_sz;
+            hdr->kernel_size() += boot.z_info.tail.sz();
+            blocks.push_back(boot.z_info.tail);
+        }
 
-    // kernel dtb
-    if (access(KER_DTB_FILE, R_OK) == 0)
-        hdr->kernel_size() += restore(fd, KER_DTB_FILE);
+        // kernel dtb
+        if (parts.kernel_dtb.exists) {
+            hdr->kernel_size() += parts.kernel_dtb.data.sz();
+            blocks.push_back(parts.kernel_dtb.data);
+        }
+
+        if (boot.flags[MTK_KERNEL]) {
+            // Copy MTK headers
+            mtk_hdr m_hdr = *boot.k_hdr;
+            m_hdr.size = hdr->kernel_size();
+            io_ok &= out_strm.write(&m_hdr, sizeof(m_hdr));
+            hdr->kernel_size() += sizeof(mtk_hdr);
+        }
+        for (auto &b : blocks) {
+            if (b.sz())
+                io_ok &= out_strm.write(b.buf(), b.sz());
+        }
+        out_strm.update_size(hdr->kernel_size());
+    }
     file_align();
 
     // ramdisk
-    off.ramdisk = lseek(fd, 0, SEEK_CUR);
+    if (ramdisk.exists())
+        hdr->ramdisk_size() = ramdisk.result().sz();
     if (boot.flags[MTK_RAMDISK]) {
         // Copy MTK headers
-        xwrite(fd, boot.r_hdr, sizeof(mtk_hdr));
-    }
-    if (access(RAMDISK_FILE, R_OK) == 0) {
-        mmap_data m(RAMDISK_FILE);
-        auto r_fmt = boot.r_fmt;
-        if (!skip_comp && !hdr->is_vendor() && hdr->header_version() == 4 && r_fmt != LZ4_LEGACY) {
-            // A v4 boot image ramdisk will have to be merged with other vendor ramdisks,
-            // and they have to use the exact same compression method. v4 GKIs are required to
-            // use lz4 (legacy), so hardcode the format here.
-            fprintf(stderr, "RAMDISK_FMT: [%s] -> [%s]\n", fmt2name[r_fmt], fmt2name[LZ4_LEGACY]);
-            r_fmt = LZ4_LEGACY;
-        }
-        if (!skip_comp && !COMPRESSED_ANY(check_fmt(m.buf(), m.sz())) && COMPRESSED(r_fmt)) {
-            hdr->ramdisk_size() = compress(r_fmt, fd, m.buf(), m.sz());
-        } else {
-            hdr->ramdisk_size() = xwrite(fd, m.buf(), m.sz());
-        }
+        mtk_hdr m_hdr = *boot.r_hdr;
+        m_hdr.size = hdr->ramdisk_size();
+        io_ok &= out_strm.write(&m_hdr, sizeof(m_hdr));
+        hdr->ramdisk_size() += sizeof(mtk_hdr);
+    }
+    if (ramdisk.exists()) {
+        io_ok &= out_strm.write(ramdisk.result().buf(), ramdisk.result().sz());
         file_align();
     }
+    out_strm.update_size(hdr->ramdisk_size());
 
     // second
-    off.second = lseek(fd, 0, SEEK_CUR);
-    if (access(SECOND_FILE, R_OK) == 0) {
-        hdr->second_size() = restore(fd, SECOND_FILE);
+    if (parts.second.exists) {
+        hdr->second_size() = write_part(parts.second);
         file_align();
     }
+    out_strm.update_size(hdr->second_size());
 
     // extra
-    off.extra = lseek(fd, 0, SEEK_CUR);
-    if (access(EXTRA_FILE, R_OK) == 0) {
-        mmap_data m(EXTRA_FILE);
-        if (!skip_comp && !COMPRESSED_ANY(check_fmt(m.buf(), m.sz())) && COMPRESSED(boot.e_fmt)) {
-            hdr->extra_size() = compress(boot.e_fmt, fd, m.buf(), m.sz());
-        } else {
-            hdr->extra_size() = xwrite(fd, m.buf(), m.sz());
-        }
+    if (extra.exists()) {
+        hdr->extra_size() = extra.result().sz();
+        io_ok &= out_strm.write(extra.result().buf(), extra.result().sz());
         file_align();
     }
+    if (hdr->extra_size())
+        out_strm.update_size(hdr->extra_size());
+
+    // recovery_dtbo and dtb are only part of the checksum in v1 and v2 headers
+    uint32_t ver = hdr->header_version();
 
     // recovery_dtbo
-    if (access(RECV_DTBO_FILE, R_OK) == 0) {
+    out_strm.ctx = (ver == 1 || ver == 2) ? id_sha : nullptr;
+    if (parts.recovery_dtbo.exists) {
         hdr->recovery_dtbo_offset() = lseek(fd, 0, SEEK_CUR);
-        hdr->recovery_dtbo_size() = restore(fd, RECV_DTBO_FILE);
+        hdr->recovery_dtbo_size() = write_part(parts.recovery_dtbo);
         file_align();
     }
+    out_strm.update_size(hdr->recovery_dtbo_size());
 
     // dtb
-    off.dtb = lseek(fd, 0, SEEK_CUR);
-    if (access(DTB_FILE, R_OK) == 0) {
-        hdr->dtb_size() = restore(fd, DTB_FILE);
+    out_strm.ctx = ver == 2 ? id_sha : nullptr;
+    if (parts.dtb.exists) {
+        hdr->dtb_size() = write_part(parts.dtb);
         file_align();
     }
+    out_strm.update_size(hdr->dtb_size());
+    out_strm.ctx = nullptr;
 
     // Directly copy ignored blobs
     if (boot.ignore.sz()) {
         // ignore.sz() should already be aligned
-        xwrite(fd, boot.ignore.buf(), boot.ignore.sz());
+        write_raw(boot.ignore.buf(), boot.ignore.sz());
     }
 
     // Proprietary stuffs
     if (boot.flags[SEANDROID_FLAG]) {
-        xwrite(fd, SEANDROID_MAGIC, 16);
+        write_raw(SEANDROID_MAGIC, 16);
         if (boot.flags[DHTB_FLAG]) {
-            xwrite(fd, "\xFF\xFF\xFF\xFF", 4);
+            write_raw("\xFF\xFF\xFF\xFF", 4);
         }
     } else if (boot.flags[LG_BUMP_FLAG]) {
-        xwrite(fd, LG_BUMP_MAGIC, 16);
+        write_raw(LG_BUMP_MAGIC, 16);
     }
 
     off.total = lseek(fd, 0, SEEK_CUR);
@@ -739,14 +1337,14 @@ void repack(const char *src_img, const char *out_img, bool skip_comp) {
         file_align_with(4096);
         off.vbmeta = lseek(fd, 0, SEEK_CUR);
         uint64_t vbmeta_size = __builtin_bswap64(boot.avb_footer->vbmeta_size);
-        xwrite(fd, boot.vbmeta, vbmeta_size);
+        write_raw(boot.vbmeta, vbmeta_size);
     }
 
     // Pad image to original size if not chromeos (as it requires post processing)
     if (!boot.flags[CHROMEOS_FLAG]) {
         off_t current = lseek(fd, 0, SEEK_CUR);
         if (current < boot.map.sz()) {
-            write_zero(fd, boot.map.sz() - current);
+            write_hole(fd, boot.map.sz() - current);
         }
     }
 
@@ -754,19 +1352,17 @@ void repack(const char *src_img, const char *out_img, bool skip_comp) {
      * Patch the image
      ******************/
 
+    if (!io_ok) {
+        close(fd);
+        LOGE("Failed to write [%s]\n", out_img);
+        return false;
+    }
+
     // Map output image as rw
     mmap_data out(out_img, true);
-
-    // MTK headers
-    if (boot.flags[MTK_KERNEL]) {
-        auto m_hdr = reinterpret_cast<mtk_hdr *>(out.buf() + off.kernel);
-        m_hdr->size = hdr->kernel_size();
-        hdr->kernel_size() += sizeof(mtk_hdr);
-    }
-    if (boot.flags[MTK_RAMDISK]) {
-        auto m_hdr = reinterpret_cast<mtk_hdr *>(out.buf() + off.ramdisk);
-        m_hdr->size = hdr->ramdisk_size();
-        hdr->ramdisk_size() += sizeof(mtk_hdr);
+    if (out.buf() == nullptr) {
+        close(fd);
+        return false;
     }
 
     // Make sure header size matches
@@ -774,34 +1370,8 @@ void repack(const char *src_img, const char *out_img, bool skip_comp) {
 
     // Update checksum
     if (char *id = hdr->id()) {
-        auto ctx = get_sha(!boot.flags[SHA256_FLAG]);
-        uint32_t size = hdr->kernel_size();
-        ctx->update(byte_view(out.buf() + off.kernel, size));
-        ctx->update(byte_view(&size, sizeof(size)));
-        size = hdr->ramdisk_size();
-        ctx->update(byte_view(out.buf() + off.ramdisk, size));
-        ctx->update(byte_view(&size, sizeof(size)));
-        size = hdr->second_size();
-        ctx->update(byte_view(out.buf() + off.second, size));
-        ctx->update(byte_view(&size, sizeof(size)));
-        size = hdr->extra_size();
-        if (size) {
-            ctx->update(byte_view(out.buf() + off.extra, size));
-            ctx->update(byte_view(&size, sizeof(size)));
-        }
-        uint32_t ver = hdr->header_version();
-        if (ver == 1 || ver == 2) {
-            size = hdr->recovery_dtbo_size();
-            ctx->update(byte_view(out.buf() + hdr->recovery_dtbo_offset(), size));
-            ctx->update(byte_view(&size, sizeof(size)));
-        }
-        if (ver == 2) {
-            size = hdr->dtb_size();
-            ctx->update(byte_view(out.buf() + off.dtb, size));
-            ctx->update(byte_view(&size, sizeof(size)));
-        }
         memset(id, 0, BOOT_ID_SIZE);
-        ctx->finalize_into(byte_data(id, ctx->output_size()));
+        id_ctx->finalize_into(byte_data(id, id_ctx->output_size()));
     }
 
     // Print new header info
@@ -832,6 +1402,8 @@ void repack(const char *src_img, const char *out_img, bool skip_comp) {
         auto d_hdr = reinterpret_cast<dhtb_hdr *>(out.buf());
         memcpy(d_hdr, DHTB_MAGIC, 8);
         d_hdr->size = off.total - sizeof(dhtb_hdr);
+        // The digest starts with the boot header, which is only final once the id is
+        // known, so it cannot be computed while writing and needs its own pass
         sha256_hash(byte_view(out.buf() + sizeof(dhtb_hdr), d_hdr->size),
                     byte_data(d_hdr->checksum, 32));
     } else if (boot.flags[BLOB_FLAG]) {
@@ -840,17 +1412,36 @@ void repack(const char *src_img, const char *out_img, bool skip_comp) {
         b_hdr->size = off.total - sizeof(blob_hdr);
     }
 
+    if (boot.flags[AVB_FLAG]) {
+        // The hash covers the whole image starting from its very first byte, so just like
+        // the DHTB digest, it can only be computed after the header is final
+        update_avb_hashes(byte_view(out.buf(), off.total),
+                          byte_data(out.buf() + off.vbmeta,
+                                    __builtin_bswap64(boot.avb_footer->vbmeta_size)),
+                          avb_partition_name(boot));
+    }
+
     // Sign the image after we finish patching the boot image
     if (boot.flags[AVB1_SIGNED_FLAG]) {
         byte_view payload(out.buf() + off.header, off.total - off.header);
         auto sig = rust::sign_boot_image(payload, "/boot", nullptr, nullptr);
         if (!sig.empty()) {
-            lseek(fd, off.total, SEEK_SET);
-            xwrite(fd, sig.data(), sig.size());
+            io_ok = lseek(fd, off.total, SEEK_SET) == off.total;
+            write_raw(sig.data(), sig.size());
         }
     }
 
     close(fd);
+    if (!io_ok) {
+        LOGE("Failed to write [%s]\n", out_img);
+        return false;
+    }
+
+    if (opts.sparse && !write_sparse(out_img)) {
+        LOGE("Failed to write sparse image [%s]\n", out_img);
+        return false;
+    }
+    return true;
 }
 
 int verify(const char *image, const char *cert) {
@@ -877,7 +1468,7 @@ int sign(const char *image, const char *name, const char *cert, const char *key)
         return 1;
     }
     // Wipe out rest of tail
-    write_zero(fd, boot.map.sz() - lseek(fd, 0, SEEK_CUR));
+    write_hole(fd, boot.map.sz() - lseek(fd, 0, SEEK_CUR));
     close(fd);
     return 0;
 }
@@ -108,6 +108,8 @@ struct AvbVBMetaImageHeader {
 #define BOOT_ARGS_SIZE 512
 #define BOOT_EXTRA_ARGS_SIZE 1024
 #define VENDOR_BOOT_ARGS_SIZE 2048
+#define SHA256_DIGEST_SIZE 32
+#define SHA_DIGEST_SIZE 20
 #define VENDOR_RAMDISK_NAME_SIZE 32
 #define VENDOR_RAMDISK_TABLE_ENTRY_BOARD_ID_SIZE 16
 
@@ -389,8 +391,8 @@ struct dyn_img_hdr {
 
     const void *raw_hdr() const { return raw; }
     void print() const;
-    void dump_hdr_file() const;
-    void load_hdr_file();
+    void dump_hdr_file(const char *file) const;
+    void load_hdr_file(const char *file);
 
 protected:
     union {
@@ -590,8 +592,8 @@ struct boot_img {
     // Memory map of the whole image
     const mmap_data map;
 
-    // Android image header
-    const dyn_img_hdr *hdr;
+    // Android image header, nullptr if the image could not be parsed
+    const dyn_img_hdr *hdr = nullptr;
 
     // Flags to indicate the state of current boot image
     std::bitset<BOOT_FLAGS_MAX> flags;
@@ -653,7 +655,19 @@ struct boot_img {
     // Blocks defined in header but we do not care
     byte_view ignore;
 
-    boot_img(const char *);
+    // Only parse the header, block offsets and the AVB footer, never touching the
+    // data of any block. Formats, kernel dtb, MTK/zImage headers and signatures
+    // are left unresolved, and block sizes are exactly as stored in the header.
+    // Headers are only searched in the first MiB, and apart from the header and the
+    // first bytes of the tail, the mapping is PROT_NONE: read blocks with pread.
+    // avb_footer points to footer_copy, and vbmeta is not readable.
+    bool hdr_only = false;
+    // Only opened in hdr_only mode
+    int fd = -1;
+    AvbFooter footer_copy;
+
+    // Exits if the image cannot be parsed, unless exit_on_error is false
+    boot_img(const char *, bool exit_on_error = true, bool hdr_only = false);
     ~boot_img();
 
     bool parse_image(const uint8_t *addr, format_t type);
@@ -663,4 +677,6 @@ struct boot_img {
     rust::Slice<const uint8_t> get_payload() const { return payload; }
     rust::Slice<const uint8_t> get_tail() const { return tail; }
     bool verify(const char *cert = nullptr) const;
+    // Whether the AVB hash descriptor of the image matches its contents
+    bool verify_avb() const;
 };
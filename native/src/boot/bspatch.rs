@@ -0,0 +1,224 @@
+use std::borrow::Cow;
+
+use base::{error, LoggedError, LoggedResult};
+
+use crate::ffi;
+
+// Patches generated by bsdiff, as used in the SOURCE_BSDIFF operations of OTA
+// payloads. Both the original BSDIFF40 format and the BSDF2 format of AOSP's
+// bsdiff are supported.
+//
+// Header (32 bytes):
+//   "BSDIFF40", or "BSDF2" followed by the compressor of each of the 3 blocks
+//   ctrl block size, diff block size, new file size (offtin encoded)
+// The ctrl, diff and extra blocks follow, each compressed individually.
+
+const BSDIFF_MAGIC: &[u8] = b"BSDIFF40";
+const BSDF2_MAGIC: &[u8] = b"BSDF2";
+const HEADER_SIZE: usize = 32;
+
+const BSDF2_NONE: u8 = 0;
+const BSDF2_BZ2: u8 = 1;
+const BSDF2_BROTLI: u8 = 2;
+
+macro_rules! bad_patch {
+    ($($args:tt)*) => {{
+        error!("bspatch: {}", format_args!($($args)*));
+        LoggedError::default()
+    }};
+}
+
+// Collects the output of the C++ decoders
+pub struct BufSink(Vec<u8>);
+
+impl BufSink {
+    pub fn extend(&mut self, data: &[u8]) {
+        self.0.extend_from_slice(data);
+    }
+}
+
+fn decode_bz2(data: &[u8]) -> LoggedResult<Vec<u8>> {
+    let mut sink = BufSink(Vec::new());
+    if !ffi::decompress_to(data, &mut sink) {
+        return Err(bad_patch!("failed to decompress block"));
+    }
+    Ok(sink.0)
+}
+
+// Sign-magnitude little endian 64-bit integer
+fn offtin(buf: &[u8]) -> i64 {
+    let v = u64::from_le_bytes(buf[..8].try_into().unwrap());
+    let y = (v & !(1 << 63)) as i64;
+    if v >> 63 != 0 {
+        -y
+    } else {
+        y
+    }
+}
+
+pub fn bspatch(src: &[u8], patch: &[u8], out: &mut [u8]) -> LoggedResult<()> {
+    apply_patch(src, patch, out, decode_bz2)
+}
+
+fn apply_patch<'a, F>(src: &[u8], patch: &'a [u8], out: &mut [u8], bz2: F) -> LoggedResult<()>
+where
+    F: Fn(&[u8]) -> LoggedResult<Vec<u8>>,
+{
+    if patch.len() < HEADER_SIZE {
+        return Err(bad_patch!("patch too short"));
+    }
+    let types = if patch.starts_with(BSDIFF_MAGIC) {
+        [BSDF2_BZ2; 3]
+    } else if patch.starts_with(BSDF2_MAGIC) {
+        [patch[5], patch[6], patch[7]]
+    } else {
+        return Err(bad_patch!("invalid magic"));
+    };
+
+    let ctrl_len = offtin(&patch[8..]);
+    let diff_len = offtin(&patch[16..]);
+    let new_size = offtin(&patch[24..]);
+    if ctrl_len < 0
+        || diff_len < 0
+        || new_size < 0
+        || ctrl_len.saturating_add(diff_len) > (patch.len() - HEADER_SIZE) as i64
+    {
+        return Err(bad_patch!("corrupted header"));
+    }
+    if new_size as usize != out.len() {
+        return Err(bad_patch!(
+            "new size mismatch ({} != {})",
+            new_size,
+            out.len()
+        ));
+    }
+
+    let decode = |t: u8, data: &'a [u8]| -> LoggedResult<Cow<'a, [u8]>> {
+        match t {
+            BSDF2_NONE => Ok(Cow::Borrowed(data)),
+            BSDF2_BZ2 => Ok(Cow::Owned(bz2(data)?)),
+            BSDF2_BROTLI => Err(bad_patch!("brotli compressed patches are not supported")),
+            _ => Err(bad_patch!("unknown compressor {}", t)),
+        }
+    };
+    let (ctrl, rest) = patch[HEADER_SIZE..].split_at(ctrl_len as usize);
+    let (diff, extra) = rest.split_at(diff_len as usize);
+    let ctrl = decode(types[0], ctrl)?;
+    let diff = decode(types[1], diff)?;
+    let extra = decode(types[2], extra)?;
+
+    let (mut ctrl_pos, mut diff_pos, mut extra_pos) = (0usize, 0usize, 0usize);
+    let (mut old_pos, mut new_pos) = (0i64, 0usize);
+    while new_pos < out.len() {
+        if ctrl_pos + 24 > ctrl.len() {
+            return Err(bad_patch!("corrupted ctrl block"));
+        }
+        let x = offtin(&ctrl[ctrl_pos..]);
+        let y = offtin(&ctrl[ctrl_pos + 8..]);
+        let z = offtin(&ctrl[ctrl_pos + 16..]);
+        ctrl_pos += 24;
+        if x < 0 || y < 0 {
+            return Err(bad_patch!("corrupted ctrl block"));
+        }
+
+        // Add old data to the diff block
+        if x as u64 > (out.len() - new_pos) as u64 || x as u64 > (diff.len() - diff_pos) as u64 {
+            return Err(bad_patch!("corrupted patch"));
+        }
+        let x = x as usize;
+        for i in 0..x {
+            let mut b = diff[diff_pos + i];
+            let old = old_pos.saturating_add(i as i64);
+            if old >= 0 && (old as usize) < src.len() {
+                b = b.wrapping_add(src[old as usize]);
+            }
+            out[new_pos + i] = b;
+        }
+        diff_pos += x;
+        new_pos += x;
+        old_pos = old_pos.saturating_add(x as i64);
+
+        // Copy the extra block
+        if y as u64 > (out.len() - new_pos) as u64 || y as u64 > (extra.len() - extra_pos) as u64 {
+            return Err(bad_patch!("corrupted patch"));
+        }
+        let y = y as usize;
+        out[new_pos..new_pos + y].copy_from_slice(&extra[extra_pos..extra_pos + y]);
+        extra_pos += y;
+        new_pos += y;
+        old_pos = old_pos.saturating_add(z);
+    }
+    Ok(())
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn offtout(v: i64) -> [u8; 8] {
+        let m = v.unsigned_abs();
+        (if v < 0 { m | (1 << 63) } else { m }).to_le_bytes()
+    }
+
+    // old:  0 1 2 ... 63
+    // new:  old[0..16] + 1, "extra", old[40..48] as is
+    fn make_patch(magic: &[u8]) -> (Vec<u8>, Vec<u8>, Vec<u8>) {
+        let old: Vec<u8> = (0..64).collect();
+        let mut ctrl = Vec::new();
+        for (x, y, z) in [(16, 5, 24), (8, 0, 0)] {
+            ctrl.extend_from_slice(&offtout(x));
+            ctrl.extend_from_slice(&offtout(y));
+            ctrl.extend_from_slice(&offtout(z));
+        }
+        let mut diff = vec![1u8; 16];
+        diff.extend_from_slice(&[0u8; 8]);
+        let extra = b"extra".to_vec();
+
+        let mut new: Vec<u8> = (1..17).collect();
+        new.extend_from_slice(&extra);
+        new.extend(40..48);
+
+        let mut patch = magic.to_vec();
+        patch.extend_from_slice(&offtout(ctrl.len() as i64));
+        patch.extend_from_slice(&offtout(diff.len() as i64));
+        patch.extend_from_slice(&offtout(new.len() as i64));
+        patch.extend_from_slice(&ctrl);
+        patch.extend_from_slice(&diff);
+        patch.extend_from_slice(&extra);
+        (old, patch, new)
+    }
+
+    // The blocks of the test patches are stored, so bzip2 decoding is the identity
+    fn stored(data: &[u8]) -> LoggedResult<Vec<u8>> {
+        Ok(data.to_vec())
+    }
+
+    #[test]
+    fn bsdiff40() {
+        let (old, patch, new) = make_patch(BSDIFF_MAGIC);
+        let mut out = vec![0u8; new.len()];
+        assert!(apply_patch(&old, &patch, &mut out, stored).is_ok());
+        assert_eq!(out, new);
+    }
+
+    #[test]
+    fn bsdf2() {
+        let (old, patch, new) = make_patch(b"BSDF2\x00\x00\x00");
+        let mut out = vec![0u8; new.len()];
+        assert!(apply_patch(&old, &patch, &mut out, |_| panic!()).is_ok());
+        assert_eq!(out, new);
+
+        let (old, patch, _) = make_patch(b"BSDF2\x00\x02\x00");
+        assert!(apply_patch(&old, &patch, &mut out, stored).is_err());
+    }
+
+    #[test]
+    fn corrupted() {
+        let (old, mut patch, new) = make_patch(BSDIFF_MAGIC);
+        let mut out = vec![0u8; new.len() + 1];
+        assert!(apply_patch(&old, &patch, &mut out, stored).is_err());
+        patch.truncate(HEADER_SIZE + 30);
+        let mut out = vec![0u8; new.len()];
+        assert!(apply_patch(&old, &patch, &mut out, stored).is_err());
+    }
+}
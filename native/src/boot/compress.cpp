@@ -1,5 +1,11 @@
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <atomic>
 #include <memory>
 #include <functional>
+#include <vector>
 
 #include <zlib.h>
 #include <bzlib.h>
@@ -7,6 +13,7 @@
 #include <lz4.h>
 #include <lz4frame.h>
 #include <lz4hc.h>
+#include <xxhash.h>
 #include <zopfli/util.h>
 #include <zopfli/deflate.h>
 
@@ -14,6 +21,8 @@
 
 #include "magiskboot.hpp"
 #include "compress.hpp"
+#include "boot-rs.hpp"
+#include "parallel.hpp"
 
 using namespace std;
 
@@ -22,6 +31,28 @@ using namespace std;
 constexpr size_t CHUNK = 0x40000;
 constexpr size_t LZ4_UNCOMPRESSED = 0x800000;
 constexpr size_t LZ4_COMPRESSED = LZ4_COMPRESSBOUND(LZ4_UNCOMPRESSED);
+// Maximum number of legacy LZ4 blocks compressed at the same time, which bounds
+// the memory used by the encoder to this many blocks of input and of output
+constexpr int LZ4_MAX_BATCH = 8;
+constexpr size_t XZ_MT_BLOCK_SZ = 0x800000;
+constexpr size_t GZ_MT_BLOCK_SZ = 0x20000;
+constexpr size_t IO_BUF_SZ = 0x800000;
+
+static int get_threads(const encoder_opts &opts) {
+    return opts.threads > 0 ? opts.threads : max_threads();
+}
+
+static int get_level(const encoder_opts &opts, int min, int max, int def) {
+    return opts.level < 0 ? def : std::clamp(opts.level, min, max);
+}
+
+static int get_window(const encoder_opts &opts) {
+    return opts.window ? std::clamp(opts.window, 9, 15) : 15;
+}
+
+static int get_strategy(const encoder_opts &opts) {
+    return opts.strategy < 0 ? Z_DEFAULT_STRATEGY : opts.strategy;
+}
 
 class gz_strm : public filter_out_stream {
 public:
@@ -51,14 +82,15 @@ protected:
         COPY
     } mode;
 
-    gz_strm(mode_t mode, out_strm_ptr &&base) :
+    gz_strm(mode_t mode, out_strm_ptr &&base, const encoder_opts &opts = {}) :
             filter_out_stream(std::move(base)), mode(mode), strm{}, outbuf{0} {
         switch(mode) {
         case DECODE:
             inflateInit2(&strm, 15 | 16);
             break;
         case ENCODE:
-            deflateInit2(&strm, 9, Z_DEFLATED, 15 | 16, 8, Z_DEFAULT_STRATEGY);
+            deflateInit2(&strm, get_level(opts, 0, 9, 9), Z_DEFLATED,
+                         get_window(opts) | 16, 8, get_strategy(opts));
             break;
         default:
             break;
@@ -146,79 +178,275 @@ public:
 
 class gz_encoder : public gz_strm {
 public:
-    explicit gz_encoder(out_strm_ptr &&base) : gz_strm(ENCODE, std::move(base)) {};
+    gz_encoder(out_strm_ptr &&base, const encoder_opts &opts) :
+            gz_strm(ENCODE, std::move(base), opts) {};
 };
 
+// Pigz style parallel gzip encoder. The input is split into blocks that are deflated
+// concurrently, each primed with the preceding window of input as its dictionary.
+// Non-final blocks end with Z_SYNC_FLUSH, so the raw deflate streams can be concatenated
+// in order into a single gzip member that any inflate implementation can decode.
+class gz_mt_encoder : public chunk_out_stream {
+public:
+    gz_mt_encoder(out_strm_ptr &&base, const encoder_opts &opts) :
+        chunk_out_stream(std::move(base), get_block_sz(opts) * get_threads(opts)),
+        level(get_level(opts, 0, 9, 9)), window(get_window(opts)), strategy(get_strategy(opts)),
+        block_sz(get_block_sz(opts)), dict(1 << window), dict_len(0),
+        crc(crc32_z(0L, Z_NULL, 0)), in_total(0), finished(false) {
+        // Same as the header written by deflate()
+        uint8_t xfl = 0;
+        if (level == 9)
+            xfl = 2;
+        else if (level < 2 || strategy >= Z_HUFFMAN_ONLY)
+            xfl = 4;
+        const uint8_t header[] = {
+            31, 139,    /* ID1, ID2 */
+            8,          /* CM */
+            0,          /* FLG */
+            0, 0, 0, 0, /* MTIME */
+            xfl,        /* XFL */
+            3,          /* OS follows Unix conventions. */
+        };
+        bwrite(header, sizeof(header));
+    }
+
+    ~gz_mt_encoder() override {
+        finalize();
+
+        // Terminate the deflate stream with an empty final block if necessary
+        if (!finished)
+            bwrite("\x03\x00", 2);
+
+        uint8_t trailer[8];
+        for (int i = 0; i < 4; ++i) {
+            trailer[i] = (crc >> (i * 8)) & 0xFF;           /* CRC */
+            trailer[i + 4] = (in_total >> (i * 8)) & 0xFF;  /* ISIZE */
+        }
+        bwrite(trailer, sizeof(trailer));
+    }
+
+protected:
+    bool write_chunk(const void *buf, size_t len, bool final) override {
+        auto in = static_cast<const uint8_t *>(buf);
+
+        struct block {
+            vector<uint8_t> out;
+            size_t len = 0;
+            unsigned long crc = 0;
+            bool ok = false;
+        };
+        size_t num = (len + block_sz - 1) / block_sz;
+        vector<block> blocks(num);
+
+        parallel_for(num, [&](size_t i) {
+            auto &b = blocks[i];
+            size_t off = i * block_sz;
+            bool last = final && i == num - 1;
+            b.len = std::min(block_sz, len - off);
+            b.crc = crc32_z(0L, in + off, b.len);
+
+            z_stream z{};
+            if (deflateInit2(&z, level, Z_DEFLATED, -window, 8, strategy) != Z_OK)
+                return;
+            // Blocks are at least as large as the window, so the dictionary of all
+            // blocks other than the first one can be found in the current chunk
+            if (i != 0) {
+                deflateSetDictionary(&z, in + off - dict.sz(), dict.sz());
+            } else if (dict_len) {
+                deflateSetDictionary(&z, dict.buf(), dict_len);
+            }
+
+            // Reserve additional space for the sync flush marker
+            b.out.resize(deflateBound(&z, b.len) + 16);
+            z.next_in = (Bytef *) (in + off);
+            z.avail_in = b.len;
+            z.next_out = b.out.data();
+            z.avail_out = b.out.size();
+            int code = deflate(&z, last ? Z_FINISH : Z_SYNC_FLUSH);
+            b.ok = z.avail_in == 0 && z.avail_out != 0 && code == (last ? Z_STREAM_END : Z_OK);
+            b.out.resize(b.out.size() - z.avail_out);
+            deflateEnd(&z);
+        });
+
+        for (auto &b : blocks) {
+            if (!b.ok) {
+                LOGW("gzip encode failed\n");
+                return false;
+            }
+            if (!bwrite(b.out.data(), b.out.size()))
+                return false;
+            crc = crc32_combine(crc, b.crc, b.len);
+            in_total += b.len;
+        }
+
+        // Save the last window of input as the dictionary of the next chunk
+        if (len >= dict.sz()) {
+            dict_len = dict.sz();
+            memcpy(dict.buf(), in + len - dict_len, dict_len);
+        } else {
+            size_t keep = std::min(dict_len, dict.sz() - len);
+            memmove(dict.buf(), dict.buf() + dict_len - keep, keep);
+            memcpy(dict.buf() + keep, in, len);
+            dict_len = keep + len;
+        }
+
+        finished = final;
+        return true;
+    }
+
+private:
+    int level;
+    int window;
+    int strategy;
+    size_t block_sz;
+    heap_data dict;
+    size_t dict_len;
+    unsigned long crc;
+    uint32_t in_total;
+    bool finished;
+
+    static size_t get_block_sz(const encoder_opts &opts) {
+        // Blocks cannot be smaller than the maximum window size
+        size_t sz = opts.block_size ? opts.block_size : GZ_MT_BLOCK_SZ;
+        return std::max<size_t>(sz, 1 << 15);
+    }
+};
+
+// By default, the input is deflated as a single stream, one master block after another.
+// With opts.blocks, every master block is deflated independently, each on its own thread.
+// Non-final blocks then end with an empty stored block (the same as zlib's Z_SYNC_FLUSH)
+// to align the bitstream to a byte boundary, so the compressed blocks can simply be
+// concatenated in order. The output does not depend on the number of threads used.
 class zopfli_encoder : public chunk_out_stream {
 public:
-    explicit zopfli_encoder(out_strm_ptr &&base) :
-        chunk_out_stream(std::move(base), ZOPFLI_MASTER_BLOCK_SIZE),
-        zo{}, out(nullptr), outsize(0), crc(crc32_z(0L, Z_NULL, 0)), in_total(0), bp(0) {
+    zopfli_encoder(out_strm_ptr &&base, const encoder_opts &opts) :
+        chunk_out_stream(std::move(base),
+                         ZOPFLI_MASTER_BLOCK_SIZE * (opts.blocks ? get_threads(opts) : 1)),
+        zo{}, split(opts.blocks), out(nullptr), outsize(0), bp(0),
+        crc(crc32_z(0L, Z_NULL, 0)), in_total(0), finished(false) {
         ZopfliInitOptions(&zo);
 
         // This config is already better than gzip -9
         zo.numiterations = 1;
         zo.blocksplitting = 0;
 
-        ZOPFLI_APPEND_DATA(31, &out, &outsize);  /* ID1 */
-        ZOPFLI_APPEND_DATA(139, &out, &outsize); /* ID2 */
-        ZOPFLI_APPEND_DATA(8, &out, &outsize);   /* CM */
-        ZOPFLI_APPEND_DATA(0, &out, &outsize);   /* FLG */
-        /* MTIME */
-        ZOPFLI_APPEND_DATA(0, &out, &outsize);
-        ZOPFLI_APPEND_DATA(0, &out, &outsize);
-        ZOPFLI_APPEND_DATA(0, &out, &outsize);
-        ZOPFLI_APPEND_DATA(0, &out, &outsize);
-
-        ZOPFLI_APPEND_DATA(2, &out, &outsize);  /* XFL, 2 indicates best compression. */
-        ZOPFLI_APPEND_DATA(3, &out, &outsize);  /* OS follows Unix conventions. */
+        const uint8_t header[] = {
+            31, 139,    /* ID1, ID2 */
+            8,          /* CM */
+            0,          /* FLG */
+            0, 0, 0, 0, /* MTIME */
+            2,          /* XFL, 2 indicates best compression. */
+            3,          /* OS follows Unix conventions. */
+        };
+        bwrite(header, sizeof(header));
     }
 
     ~zopfli_encoder() override {
         finalize();
 
-        /* CRC */
-        ZOPFLI_APPEND_DATA(crc % 256, &out, &outsize);
-        ZOPFLI_APPEND_DATA((crc >> 8) % 256, &out, &outsize);
-        ZOPFLI_APPEND_DATA((crc >> 16) % 256, &out, &outsize);
-        ZOPFLI_APPEND_DATA((crc >> 24) % 256, &out, &outsize);
-
-        /* ISIZE */
-        ZOPFLI_APPEND_DATA(in_total % 256, &out, &outsize);
-        ZOPFLI_APPEND_DATA((in_total >> 8) % 256, &out, &outsize);
-        ZOPFLI_APPEND_DATA((in_total >> 16) % 256, &out, &outsize);
-        ZOPFLI_APPEND_DATA((in_total >> 24) % 256, &out, &outsize);
-
-        bwrite(out, outsize);
+        // The input size is a multiple of the chunk size, terminate the deflate stream
+        // with an empty final fixed Huffman block: BFINAL = 1, BTYPE = 01, then the
+        // 7 bit end of block code, which is all zeros
+        if (!finished) {
+            add_bit(1, &bp, &out, &outsize);
+            add_bit(1, &bp, &out, &outsize);
+            for (int i = 0; i < 8; ++i)
+                add_bit(0, &bp, &out, &outsize);
+        }
+        if (outsize)
+            bwrite(out, outsize);
         free(out);
+
+        uint8_t trailer[8];
+        for (int i = 0; i < 4; ++i) {
+            trailer[i] = (crc >> (i * 8)) & 0xFF;           /* CRC */
+            trailer[i + 4] = (in_total >> (i * 8)) & 0xFF;  /* ISIZE */
+        }
+        bwrite(trailer, sizeof(trailer));
     }
 
 protected:
     bool write_chunk(const void *buf, size_t len, bool final) override {
         auto in = static_cast<const unsigned char *>(buf);
+        finished = final;
 
-        in_total += len;
-        crc = crc32_z(crc, in, len);
+        if (!split) {
+            in_total += len;
+            crc = crc32_z(crc, in, len);
 
-        ZopfliDeflatePart(&zo, 2, final, in, 0, len, &bp, &out, &outsize);
+            ZopfliDeflatePart(&zo, 2, final, in, 0, len, &bp, &out, &outsize);
 
-        // ZOPFLI_APPEND_DATA is extremely dumb, so we always preserve the
-        // last byte to make sure that realloc is used instead of malloc
-        if (!bwrite(out, outsize - 1))
-            return false;
-        out[0] = out[outsize - 1];
-        outsize = 1;
+            // ZOPFLI_APPEND_DATA is extremely dumb, so we always preserve the
+            // last byte to make sure that realloc is used instead of malloc
+            if (!bwrite(out, outsize - 1))
+                return false;
+            out[0] = out[outsize - 1];
+            outsize = 1;
+            return true;
+        }
 
-        return true;
+        struct block {
+            unsigned char *out = nullptr;
+            size_t outsize = 0;
+            size_t len = 0;
+            unsigned long crc = 0;
+        };
+        size_t num = (len + ZOPFLI_MASTER_BLOCK_SIZE - 1) / ZOPFLI_MASTER_BLOCK_SIZE;
+        vector<block> blocks(num);
+
+        parallel_for(num, [&](size_t i) {
+            auto &b = blocks[i];
+            size_t off = i * ZOPFLI_MASTER_BLOCK_SIZE;
+            bool last = final && i == num - 1;
+            b.len = std::min<size_t>(ZOPFLI_MASTER_BLOCK_SIZE, len - off);
+            b.crc = crc32_z(0L, in + off, b.len);
+
+            unsigned char bp = 0;
+            ZopfliDeflatePart(&zo, 2, last, in + off, 0, b.len, &bp, &b.out, &b.outsize);
+            if (!last)
+                sync_flush(&bp, &b.out, &b.outsize);
+        });
+
+        bool ok = true;
+        for (auto &b : blocks) {
+            ok = ok && bwrite(b.out, b.outsize);
+            crc = crc32_combine(crc, b.crc, b.len);
+            in_total += b.len;
+            free(b.out);
+        }
+        return ok;
     }
 
 private:
     ZopfliOptions zo;
+    bool split;
+    // Pending bits of the single stream
     unsigned char *out;
     size_t outsize;
+    unsigned char bp;
     unsigned long crc;
     uint32_t in_total;
-    unsigned char bp;
+    bool finished;
+
+    static void add_bit(int bit, unsigned char *bp, unsigned char **out, size_t *outsize) {
+        if (*bp == 0)
+            ZOPFLI_APPEND_DATA(0, out, outsize);
+        (*out)[*outsize - 1] |= bit << *bp;
+        *bp = (*bp + 1) & 7;
+    }
+
+    // Append an empty non-final stored block and pad to a byte boundary
+    static void sync_flush(unsigned char *bp, unsigned char **out, size_t *outsize) {
+        // BFINAL = 0, BTYPE = 00
+        for (int i = 0; i < 3; ++i)
+            add_bit(0, bp, out, outsize);
+        // Padding bits are already zero, then LEN = 0x0000, NLEN = 0xFFFF
+        *bp = 0;
+        ZOPFLI_APPEND_DATA(0x00, out, outsize);
+        ZOPFLI_APPEND_DATA(0x00, out, outsize);
+        ZOPFLI_APPEND_DATA(0xFF, out, outsize);
+        ZOPFLI_APPEND_DATA(0xFF, out, outsize);
+    }
 };
 
 class bz_strm : public filter_out_stream {
@@ -245,14 +473,14 @@ protected:
         ENCODE
     } mode;
 
-    bz_strm(mode_t mode, out_strm_ptr &&base) :
+    bz_strm(mode_t mode, out_strm_ptr &&base, const encoder_opts &opts = {}) :
             filter_out_stream(std::move(base)), mode(mode), strm{}, outbuf{0} {
         switch(mode) {
         case DECODE:
             BZ2_bzDecompressInit(&strm, 0, 0);
             break;
         case ENCODE:
-            BZ2_bzCompressInit(&strm, 9, 0, 0);
+            BZ2_bzCompressInit(&strm, get_level(opts, 1, 9, 9), 0, 0);
             break;
         }
     }
@@ -296,7 +524,8 @@ public:
 
 class bz_encoder : public bz_strm {
 public:
-    explicit bz_encoder(out_strm_ptr &&base) : bz_strm(ENCODE, std::move(base)) {};
+    bz_encoder(out_strm_ptr &&base, const encoder_opts &opts) :
+            bz_strm(ENCODE, std::move(base), opts) {};
 };
 
 class lzma_strm : public filter_out_stream {
@@ -314,15 +543,16 @@ protected:
     enum mode_t {
         DECODE,
         ENCODE_XZ,
+        ENCODE_XZ_MT,
         ENCODE_LZMA
     } mode;
 
-    lzma_strm(mode_t mode, out_strm_ptr &&base) :
+    lzma_strm(mode_t mode, out_strm_ptr &&base, const encoder_opts &opts = {}) :
             filter_out_stream(std::move(base)), mode(mode), strm(LZMA_STREAM_INIT), outbuf{0} {
         lzma_options_lzma opt;
 
         // Initialize preset
-        lzma_lzma_preset(&opt, 9);
+        lzma_lzma_preset(&opt, get_level(opts, 0, 9, 9));
         lzma_filter filters[] = {
             { .id = LZMA_FILTER_LZMA2, .options = &opt },
             { .id = LZMA_VLI_UNKNOWN, .options = nullptr },
@@ -336,6 +566,19 @@ protected:
         case ENCODE_XZ:
             code = lzma_stream_encoder(&strm, filters, LZMA_CHECK_CRC32);
             break;
+        case ENCODE_XZ_MT: {
+            lzma_mt mt{};
+            mt.threads = get_threads(opts);
+            mt.block_size = opts.block_size ? opts.block_size : XZ_MT_BLOCK_SZ;
+            mt.filters = filters;
+            mt.check = LZMA_CHECK_CRC32;
+            // Every block is compressed independently, so a dictionary larger than
+            // the block size is never used and only costs memory in every thread
+            if (opt.dict_size > mt.block_size)
+                opt.dict_size = std::max<uint64_t>(mt.block_size, LZMA_DICT_SIZE_MIN);
+            code = lzma_stream_encoder_mt(&strm, &mt);
+            break;
+        }
         case ENCODE_LZMA:
             code = lzma_alone_encoder(&strm, &opt);
             break;
@@ -352,17 +595,19 @@ private:
     bool do_write(const void *buf, size_t len, lzma_action flush) {
         strm.next_in = (uint8_t *) buf;
         strm.avail_in = len;
+        int code;
         do {
             strm.avail_out = sizeof(outbuf);
             strm.next_out = outbuf;
-            int code = lzma_code(&strm, flush);
+            code = lzma_code(&strm, flush);
             if (code != LZMA_OK && code != LZMA_STREAM_END) {
                 LOGW("LZMA %s failed (%d)\n", mode ? "encode" : "decode", code);
                 return false;
             }
             if (!bwrite(outbuf, sizeof(outbuf) - strm.avail_out))
                 return false;
-        } while (strm.avail_out == 0);
+        } while (strm.avail_out == 0 || (mode == ENCODE_XZ_MT && (strm.avail_in != 0 ||
+                 (flush == LZMA_FINISH && code != LZMA_STREAM_END))));
         return true;
     }
 };
@@ -374,12 +619,21 @@ public:
 
 class xz_encoder : public lzma_strm {
 public:
-    explicit xz_encoder(out_strm_ptr &&base) : lzma_strm(ENCODE_XZ, std::move(base)) {}
+    xz_encoder(out_strm_ptr &&base, const encoder_opts &opts) :
+            lzma_strm(ENCODE_XZ, std::move(base), opts) {}
+};
+
+// Splits the input into blocks and compresses them with liblzma's worker threads
+class xz_mt_encoder : public lzma_strm {
+public:
+    xz_mt_encoder(out_strm_ptr &&base, const encoder_opts &opts) :
+            lzma_strm(ENCODE_XZ_MT, std::move(base), opts) {}
 };
 
 class lzma_encoder : public lzma_strm {
 public:
-    explicit lzma_encoder(out_strm_ptr &&base) : lzma_strm(ENCODE_LZMA, std::move(base)) {}
+    lzma_encoder(out_strm_ptr &&base, const encoder_opts &opts) :
+            lzma_strm(ENCODE_LZMA, std::move(base), opts) {}
 };
 
 class LZ4F_decoder : public filter_out_stream {
@@ -437,8 +691,9 @@ private:
 
 class LZ4F_encoder : public filter_out_stream {
 public:
-    explicit LZ4F_encoder(out_strm_ptr &&base) :
-            filter_out_stream(std::move(base)), ctx(nullptr), out_buf(nullptr), outCapacity(0) {
+    LZ4F_encoder(out_strm_ptr &&base, const encoder_opts &opts) :
+            filter_out_stream(std::move(base)), ctx(nullptr), out_buf(nullptr), outCapacity(0),
+            level(get_level(opts, 0, LZ4HC_CLEVEL_MAX, 9)) {
         LZ4F_createCompressionContext(&ctx, LZ4F_VERSION);
     }
 
@@ -451,7 +706,7 @@ public:
                     .contentChecksumFlag = LZ4F_contentChecksumEnabled,
                     .blockChecksumFlag = LZ4F_noBlockChecksum,
                 },
-                .compressionLevel = 9,
+                .compressionLevel = level,
                 .autoFlush = 1,
             };
             outCapacity = LZ4F_compressBound(BLOCK_SZ, &prefs);
@@ -495,6 +750,7 @@ private:
     LZ4F_compressionContext_t ctx;
     uint8_t *out_buf;
     size_t outCapacity;
+    int level;
 
     static constexpr size_t BLOCK_SZ = 1 << 22;
 };
@@ -546,61 +802,475 @@ private:
     uint32_t block_sz;
 };
 
-class LZ4_encoder : public chunk_out_stream {
+// Legacy LZ4 blocks are compressed independently, so compress up to one block per
+// thread concurrently, and write out the results in order. Full blocks are compressed
+// straight from the input. Only data that does not fill a block, or small writes that
+// do not add up to one block per thread yet, are buffered. Both buffers are sized for
+// the data actually written, so small inputs do not cost a full block per thread, and
+// at most LZ4_MAX_BATCH blocks are in flight, however many threads are available.
+// The output is byte-identical regardless of the number of threads used.
+class LZ4_encoder : public filter_out_stream {
 public:
-    explicit LZ4_encoder(out_strm_ptr &&base, bool lg) :
-        chunk_out_stream(std::move(base), LZ4_UNCOMPRESSED),
-        out_buf(new char[LZ4_COMPRESSED]), lg(lg), in_total(0) {
+    LZ4_encoder(out_strm_ptr &&base, bool lg, const encoder_opts &opts) :
+        filter_out_stream(std::move(base)), lg(lg), in_total(0),
+        threads(std::min(get_threads(opts), LZ4_MAX_BATCH)),
+        level(get_level(opts, 1, LZ4HC_CLEVEL_MAX, LZ4HC_CLEVEL_MAX)) {
         bwrite("\x02\x21\x4c\x18", 4);
     }
 
     ~LZ4_encoder() override {
-        finalize();
+        if (!pending.empty() && !compress_blocks(pending.data(), pending.size()))
+            LOGE("Error in finalize, file truncated\n");
         if (lg)
             bwrite(&in_total, sizeof(in_total));
-        delete[] out_buf;
     }
 
-protected:
-    bool write_chunk(const void *buf, size_t len, bool) override {
-        auto in = static_cast<const char *>(buf);
-        uint32_t block_sz = LZ4_compress_HC(in, out_buf, len, LZ4_COMPRESSED, LZ4HC_CLEVEL_MAX);
-        if (block_sz == 0) {
-            LOGW("LZ4HC compression failure\n");
-            return false;
-        }
-        if (bwrite(&block_sz, sizeof(block_sz)) && bwrite(out_buf, block_sz)) {
-            in_total += len;
-            return true;
+    bool write(const void *buf, size_t len) override {
+        auto in = static_cast<const uint8_t *>(buf);
+        if (!pending.empty()) {
+            // Fill up the buffered data to one block per thread
+            size_t copy = std::min(len, LZ4_UNCOMPRESSED * threads - pending.size());
+            pending.insert(pending.end(), in, in + copy);
+            in += copy;
+            len -= copy;
+            if (pending.size() < LZ4_UNCOMPRESSED * threads)
+                return true;
+            if (!compress_blocks(pending.data(), pending.size()))
+                return false;
+            pending.clear();
         }
-        return false;
+        size_t full = len - len % LZ4_UNCOMPRESSED;
+        if (full && !compress_blocks(in, full))
+            return false;
+        pending.insert(pending.end(), in + full, in + len);
+        return true;
     }
 
 private:
-    char *out_buf;
+    // Compress len bytes starting at a block boundary, in batches of one block per thread
+    bool compress_blocks(const uint8_t *in, size_t len) {
+        size_t num = (len + LZ4_UNCOMPRESSED - 1) / LZ4_UNCOMPRESSED;
+        for (size_t start = 0; start < num; start += threads) {
+            size_t batch = std::min<size_t>(threads, num - start);
+            const uint8_t *batch_in = in + start * LZ4_UNCOMPRESSED;
+            size_t batch_len = std::min(len - start * LZ4_UNCOMPRESSED, batch * LZ4_UNCOMPRESSED);
+
+            // Only the last block can be smaller, which bounds its output as well
+            size_t last_sz = batch_len - (batch - 1) * LZ4_UNCOMPRESSED;
+            size_t out_sz = (batch - 1) * LZ4_COMPRESSED + LZ4_COMPRESSBOUND(last_sz);
+            if (out_buf.sz() < out_sz)
+                out_buf = heap_data(out_sz);
+            auto out = reinterpret_cast<char *>(out_buf.buf());
+
+            vector<uint32_t> block_sz(batch);
+            parallel_for(batch, [&](size_t i) {
+                size_t off = i * LZ4_UNCOMPRESSED;
+                size_t sz = std::min(LZ4_UNCOMPRESSED, batch_len - off);
+                block_sz[i] = LZ4_compress_HC(reinterpret_cast<const char *>(batch_in) + off,
+                                              out + i * LZ4_COMPRESSED, sz,
+                                              LZ4_COMPRESSBOUND(sz), level);
+            }, threads);
+
+            for (size_t i = 0; i < batch; ++i) {
+                if (block_sz[i] == 0) {
+                    LOGW("LZ4HC compression failure\n");
+                    return false;
+                }
+                if (!bwrite(&block_sz[i], sizeof(block_sz[i])) ||
+                    !bwrite(out + i * LZ4_COMPRESSED, block_sz[i]))
+                    return false;
+            }
+        }
+        in_total += len;
+        return true;
+    }
+
+    vector<uint8_t> pending;
+    heap_data out_buf;
     bool lg;
     uint32_t in_total;
+    int threads;
+    int level;
+};
+
+// Since a whole LZ4 stream is available upfront when decompressing from memory,
+// all block boundaries can be indexed before decoding anything. Independent blocks
+// are then decoded in batches of one block per thread into a shared output buffer,
+// and the results are written out in order.
+struct lz4_block {
+    const uint8_t *buf;
+    uint32_t sz;
+    bool raw;                  // Stored uncompressed (LZ4F only)
+    const uint8_t *checksum;   // XXH32 of the block data, if present (LZ4F only)
+};
+
+struct lz4_frame {
+    vector<lz4_block> blocks;
+    size_t max_block_sz;
+    const uint8_t *checksum;   // XXH32 of the frame content, if present
 };
 
-out_strm_ptr get_encoder(format_t type, out_strm_ptr &&base) {
+static uint32_t read_le32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static bool lz4_decode_blocks(const lz4_frame &frame, out_stream &out, int max) {
+    size_t threads = std::min<size_t>(max > 0 ? max : max_threads(), frame.blocks.size());
+    if (threads == 0)
+        return true;
+
+    size_t max_sz = frame.max_block_sz;
+    heap_data buf(max_sz * threads);
+    vector<int> out_sz(threads);
+    XXH32_state_t *xxh = nullptr;
+    if (frame.checksum) {
+        xxh = XXH32_createState();
+        XXH32_reset(xxh, 0);
+    }
+
+    bool ok = true;
+    for (size_t start = 0; ok && start < frame.blocks.size(); start += threads) {
+        size_t num = std::min(threads, frame.blocks.size() - start);
+        parallel_for(num, [&](size_t i) {
+            auto &b = frame.blocks[start + i];
+            auto dest = reinterpret_cast<char *>(buf.buf() + i * max_sz);
+            if (b.checksum && XXH32(b.buf, b.sz, 0) != read_le32(b.checksum)) {
+                out_sz[i] = -1;
+            } else if (b.raw) {
+                if (b.sz > max_sz) {
+                    out_sz[i] = -1;
+                } else {
+                    memcpy(dest, b.buf, b.sz);
+                    out_sz[i] = b.sz;
+                }
+            } else {
+                out_sz[i] = LZ4_decompress_safe(
+                        reinterpret_cast<const char *>(b.buf), dest, b.sz, max_sz);
+            }
+        });
+
+        for (size_t i = 0; i < num; ++i) {
+            if (out_sz[i] < 0) {
+                LOGW("LZ4 block decode failure (%d)\n", out_sz[i]);
+                ok = false;
+                break;
+            }
+            auto p = buf.buf() + i * max_sz;
+            if (xxh)
+                XXH32_update(xxh, p, out_sz[i]);
+            if (!out.write(p, out_sz[i])) {
+                ok = false;
+                break;
+            }
+        }
+    }
+
+    if (xxh) {
+        if (ok && XXH32_digest(xxh) != read_le32(frame.checksum)) {
+            LOGW("LZ4F decode error: content checksum mismatch\n");
+            ok = false;
+        }
+        XXH32_freeState(xxh);
+    }
+    return ok;
+}
+
+// Mirrors LZ4_decoder: the legacy magic may appear again between blocks when
+// streams are concatenated, and anything that does not form a complete block
+// (e.g. the size trailer of LZ4_LG) ends the stream.
+static void lz4_legacy_index(byte_view in, lz4_frame &frame) {
+    frame.max_block_sz = LZ4_UNCOMPRESSED;
+    frame.checksum = nullptr;
+    const uint8_t *p = in.buf();
+    const uint8_t *end = p + in.sz();
+    while (end - p >= 4) {
+        uint32_t block_sz = read_le32(p);
+        p += 4;
+        if (block_sz == 0x184C2102)
+            continue;
+        if (block_sz > LZ4_COMPRESSED || block_sz > size_t(end - p))
+            break;
+        frame.blocks.push_back({ p, block_sz, false, nullptr });
+        p += block_sz;
+    }
+}
+
+// Returns false if the stream cannot be decoded block by block, either because it
+// is malformed or because it uses linked blocks or dictionaries.
+static bool lz4f_index(byte_view in, vector<lz4_frame> &frames) {
+    const uint8_t *p = in.buf();
+    const uint8_t *end = p + in.sz();
+    while (end - p >= 7 && read_le32(p) == 0x184D2204) {
+        uint8_t flg = p[4];
+        uint8_t bd = p[5];
+        if ((flg >> 6) != 1 || !(flg & 0x20) || (flg & 0x1))
+            return false;
+        size_t desc_sz = 2 + (flg & 0x8 ? 8 : 0);
+        if (size_t(end - p) < 4 + desc_sz + 1 ||
+            ((XXH32(p + 4, desc_sz, 0) >> 8) & 0xFF) != p[4 + desc_sz])
+            return false;
+        p += 4 + desc_sz + 1;
+
+        auto &frame = frames.emplace_back();
+        switch ((bd >> 4) & 0x7) {
+        case LZ4F_max64KB:  frame.max_block_sz = 1 << 16; break;
+        case LZ4F_max256KB: frame.max_block_sz = 1 << 18; break;
+        case LZ4F_max1MB:   frame.max_block_sz = 1 << 20; break;
+        case LZ4F_max4MB:   frame.max_block_sz = 1 << 22; break;
+        default: return false;
+        }
+        bool block_checksum = flg & 0x10;
+        for (;;) {
+            if (end - p < 4)
+                return false;
+            uint32_t block_sz = read_le32(p);
+            p += 4;
+            if (block_sz == 0)
+                break;
+            bool raw = block_sz & 0x80000000U;
+            block_sz &= 0x7FFFFFFFU;
+            if (block_sz + (block_checksum ? 4 : 0) > size_t(end - p))
+                return false;
+            frame.blocks.push_back({ p, block_sz, raw, block_checksum ? p + block_sz : nullptr });
+            p += block_sz + (block_checksum ? 4 : 0);
+        }
+        frame.checksum = nullptr;
+        if (flg & 0x4) {
+            if (end - p < 4)
+                return false;
+            frame.checksum = p;
+            p += 4;
+        }
+    }
+    return !frames.empty();
+}
+
+// Compute the decompressed size of an LZ4 block by walking its sequences without
+// decoding any data, so that every block knows where its output belongs upfront.
+static ssize_t lz4_block_out_sz(const uint8_t *p, size_t sz) {
+    const uint8_t *end = p + sz;
+    size_t out = 0;
+    auto read_len = [&](size_t len) -> ssize_t {
+        if (len != 15)
+            return len;
+        uint8_t b;
+        do {
+            if (p == end)
+                return -1;
+            b = *p++;
+            len += b;
+        } while (b == 255);
+        return len;
+    };
+    while (p < end) {
+        uint8_t token = *p++;
+        ssize_t lit = read_len(token >> 4);
+        if (lit < 0 || lit > end - p)
+            return -1;
+        p += lit;
+        out += lit;
+        // The last sequence only contains literals
+        if (p == end)
+            break;
+        if (end - p < 2)
+            return -1;
+        p += 2;
+        ssize_t match = read_len(token & 0xF);
+        if (match < 0)
+            return -1;
+        out += match + 4;
+    }
+    return out;
+}
+
+// Pre-size the file behind fd at its current offset, map the region, and let
+// decode() write sz bytes of output directly into it. decode() returns the actual
+// size of the output, or -1 on failure. Output shorter than sz is truncated, and
+// anything past sz has to be written to the file by decode() itself. If anything
+// fails, the file is restored to its original size and false is returned.
+static bool decode_to_fd(int fd, size_t sz, const function<ssize_t(uint8_t *)> &decode) {
+    struct stat st;
+    off_t off = lseek(fd, 0, SEEK_CUR);
+    if (sz == 0 || off < 0 || fstat(fd, &st) || !S_ISREG(st.st_mode))
+        return false;
+
+    off_t end = off + sz;
+    if (st.st_size < end) {
+        // Reserve the space upfront so running out of storage cannot SIGBUS us
+        int err = posix_fallocate(fd, st.st_size, end - st.st_size);
+        if (err == ENOSPC || (err && ftruncate(fd, end)))
+            return false;
+    }
+
+    off_t map_off = off & ~static_cast<off_t>(getpagesize() - 1);
+    size_t map_sz = end - map_off;
+    void *map = mmap(nullptr, map_sz, PROT_READ | PROT_WRITE, MAP_SHARED, fd, map_off);
+    ssize_t n = -1;
+    if (map != MAP_FAILED) {
+        n = decode(static_cast<uint8_t *>(map) + (off - map_off));
+        munmap(map, map_sz);
+    }
+
+    if (n >= 0) {
+        end = off + n;
+        if (n < static_cast<ssize_t>(sz) && st.st_size < end)
+            ftruncate(fd, std::max<off_t>(st.st_size, end));
+        lseek(fd, end, SEEK_SET);
+        return true;
+    }
+    struct stat now;
+    if (fstat(fd, &now) == 0 && now.st_size > st.st_size)
+        ftruncate(fd, st.st_size);
+    return false;
+}
+
+static bool lz4_decode_to_fd(const vector<lz4_frame> &frames, int fd) {
+    vector<const lz4_block *> blocks;
+    for (auto &frame : frames) {
+        for (auto &b : frame.blocks)
+            blocks.push_back(&b);
+    }
+
+    vector<ssize_t> out_sz(blocks.size());
+    parallel_for(blocks.size(), [&](size_t i) {
+        auto b = blocks[i];
+        out_sz[i] = b->raw ? b->sz : lz4_block_out_sz(b->buf, b->sz);
+    });
+
+    vector<size_t> out_off(blocks.size());
+    size_t total = 0;
+    for (size_t i = 0; i < blocks.size(); ++i) {
+        if (out_sz[i] < 0)
+            return false;
+        out_off[i] = total;
+        total += out_sz[i];
+    }
+
+    return decode_to_fd(fd, total, [&](uint8_t *out) -> ssize_t {
+        atomic_bool ok = true;
+        parallel_for(blocks.size(), [&](size_t i) {
+            auto b = blocks[i];
+            auto dest = out + out_off[i];
+            if (b->checksum && XXH32(b->buf, b->sz, 0) != read_le32(b->checksum)) {
+                ok = false;
+            } else if (b->raw) {
+                memcpy(dest, b->buf, b->sz);
+            } else if (LZ4_decompress_safe(reinterpret_cast<const char *>(b->buf),
+                    reinterpret_cast<char *>(dest), b->sz, out_sz[i]) != out_sz[i]) {
+                ok = false;
+            }
+        });
+        if (!ok)
+            return -1;
+
+        // Content checksums cover whole frames and have to be verified in order
+        size_t idx = 0;
+        for (auto &frame : frames) {
+            size_t n = frame.blocks.size();
+            if (frame.checksum) {
+                size_t start = n ? out_off[idx] : 0;
+                size_t len = n ? out_off[idx + n - 1] + out_sz[idx + n - 1] - start : 0;
+                if (XXH32(out + start, len, 0) != read_le32(frame.checksum))
+                    return -1;
+            }
+            idx += n;
+        }
+        return total;
+    });
+}
+
+// The last 4 bytes of a gzip member is the size of the uncompressed data modulo 2^32.
+// This is only a hint, which is checked while inflating: the output is decoded straight
+// into a region of that size, and as soon as it turns out to be longer, inflate carries on
+// from where it stopped through a buffer. Shorter output is truncated. Like gz_decoder,
+// concatenated members are decoded and anything else after the stream is ignored.
+static bool gz_decode_to_fd(byte_view in, int fd) {
+    if (in.sz() < 18)
+        return false;
+    // ISIZE is not trustworthy: deflate cannot expand data by more than 1032:1, so
+    // anything larger is corrupted or crafted, and must not be reserved on storage.
+    // Those streams are left to the streaming decoder, which does not need the size.
+    size_t sz = read_le32(in.buf() + in.sz() - 4);
+    if (sz > (uint64_t) in.sz() * 1032)
+        return false;
+    off_t off = lseek(fd, 0, SEEK_CUR);
+    if (off < 0)
+        return false;
+
+    z_stream z{};
+    if (inflateInit2(&z, 15 | 16) != Z_OK)
+        return false;
+    run_finally end([&] { inflateEnd(&z); });
+    z.next_in = const_cast<Bytef *>(in.buf());
+    z.avail_in = in.sz();
+
+    // Inflate into len bytes at out. Returns Z_OK once out is full, Z_STREAM_END
+    // when all members are decoded, or the zlib error.
+    auto inflate_to = [&](uint8_t *out, size_t len) -> int {
+        z.next_out = out;
+        z.avail_out = len;
+        for (;;) {
+            int code = inflate(&z, Z_NO_FLUSH);
+            if (code == Z_STREAM_END) {
+                if (z.avail_in < 2 || z.next_in[0] != 0x1f || z.next_in[1] != 0x8b)
+                    return Z_STREAM_END;
+                inflateReset(&z);
+            } else if (z.avail_out == 0) {
+                return Z_OK;
+            } else if (code != Z_OK) {
+                return code;
+            }
+        }
+    };
+
+    return decode_to_fd(fd, sz, [&](uint8_t *out) -> ssize_t {
+        int code = inflate_to(out, sz);
+        if (code == Z_STREAM_END)
+            return sz - z.avail_out;
+        if (code != Z_OK)
+            return -1;
+
+        // The output is larger than the hint
+        heap_data buf(CHUNK);
+        size_t total = sz;
+        do {
+            code = inflate_to(buf.buf(), buf.sz());
+            if (code != Z_OK && code != Z_STREAM_END)
+                return -1;
+            size_t n = buf.sz() - z.avail_out;
+            if (pwrite(fd, buf.buf(), n, off + total) != static_cast<ssize_t>(n))
+                return -1;
+            total += n;
+        } while (code == Z_OK);
+        return total;
+    });
+}
+
+out_strm_ptr get_encoder(format_t type, out_strm_ptr &&base, const encoder_opts &opts) {
     switch (type) {
         case XZ:
-            return make_unique<xz_encoder>(std::move(base));
+            if (opts.blocks)
+                return make_unique<xz_mt_encoder>(std::move(base), opts);
+            return make_unique<xz_encoder>(std::move(base), opts);
         case LZMA:
-            return make_unique<lzma_encoder>(std::move(base));
+            return make_unique<lzma_encoder>(std::move(base), opts);
         case BZIP2:
-            return make_unique<bz_encoder>(std::move(base));
+            return make_unique<bz_encoder>(std::move(base), opts);
         case LZ4:
-            return make_unique<LZ4F_encoder>(std::move(base));
+            return make_unique<LZ4F_encoder>(std::move(base), opts);
         case LZ4_LEGACY:
-            return make_unique<LZ4_encoder>(std::move(base), false);
+            return make_unique<LZ4_encoder>(std::move(base), false, opts);
         case LZ4_LG:
-            return make_unique<LZ4_encoder>(std::move(base), true);
+            return make_unique<LZ4_encoder>(std::move(base), true, opts);
         case ZOPFLI:
-            return make_unique<zopfli_encoder>(std::move(base));
+            return make_unique<zopfli_encoder>(std::move(base), opts);
         case GZIP:
         default:
-            return make_unique<gz_encoder>(std::move(base));
+            if (opts.blocks)
+                return make_unique<gz_mt_encoder>(std::move(base), opts);
+            return make_unique<gz_encoder>(std::move(base), opts);
     }
 }
 
@@ -623,59 +1293,144 @@ out_strm_ptr get_decoder(format_t type, out_strm_ptr &&base) {
     }
 }
 
+bool decompress(format_t type, byte_view in, out_strm_ptr &&base, int threads) {
+    switch (type) {
+        case LZ4_LEGACY:
+        case LZ4_LG: {
+            lz4_frame frame;
+            lz4_legacy_index(in, frame);
+            return lz4_decode_blocks(frame, *base, threads);
+        }
+        case LZ4: {
+            vector<lz4_frame> frames;
+            if (!lz4f_index(in, frames))
+                break;
+            for (auto &frame : frames) {
+                if (!lz4_decode_blocks(frame, *base, threads))
+                    return false;
+            }
+            return true;
+        }
+        default:
+            break;
+    }
+    auto strm = get_decoder(type, std::move(base));
+    return strm->write(in.buf(), in.sz());
+}
+
+bool decompress(format_t type, byte_view in, int fd) {
+    switch (type) {
+        case LZ4_LEGACY:
+        case LZ4_LG: {
+            vector<lz4_frame> frames(1);
+            lz4_legacy_index(in, frames[0]);
+            if (lz4_decode_to_fd(frames, fd))
+                return true;
+            break;
+        }
+        case LZ4: {
+            vector<lz4_frame> frames;
+            if (lz4f_index(in, frames) && lz4_decode_to_fd(frames, fd))
+                return true;
+            break;
+        }
+        case ZOPFLI:
+        case GZIP:
+            if (gz_decode_to_fd(in, fd))
+                return true;
+            break;
+        default:
+            break;
+    }
+    return decompress(type, in, make_unique<fd_channel>(fd));
+}
+
+// Regular files are memory mapped and handed to the codecs as a whole, or in large
+// slices when compressing. Anything else (stdin, pipes) is read through a large buffer.
+static mmap_data map_input(FILE *fp) {
+    struct stat st;
+    int fd = fileno(fp);
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+        return mmap_data(fd, st.st_size);
+    return {};
+}
+
+static int open_output(const char *outfile) {
+    if (outfile == "-"sv)
+        return STDOUT_FILENO;
+    // Opened read-write so that decoders are able to map the output
+    return xopen(outfile, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+}
+
 void decompress(char *infile, const char *outfile) {
     bool in_std = infile == "-"sv;
     bool rm_in = false;
 
     FILE *in_fp = in_std ? stdin : xfopen(infile, "re");
-    out_strm_ptr strm;
+    mmap_data map = map_input(in_fp);
+    heap_data buf(map.sz() == 0 ? IO_BUF_SZ : 0);
 
-    char buf[4096];
     size_t len;
-    while ((len = fread(buf, 1, sizeof(buf), in_fp))) {
-        if (!strm) {
-            format_t type = check_fmt(buf, len);
-
-            fprintf(stderr, "Detected format: [%s]\n", fmt2name[type]);
-
-            if (!COMPRESSED(type))
-                LOGE("Input file is not a supported compressed type!\n");
-
-            /* If user does not provide outfile, infile has to be either
-            * <path>.[ext], or '-'. Outfile will be either <path> or '-'.
-            * If the input does not have proper format, abort */
-
-            char *ext = nullptr;
-            if (outfile == nullptr) {
-                outfile = infile;
-                if (!in_std) {
-                    ext = strrchr(infile, '.');
-                    if (ext == nullptr || strcmp(ext, fmt2ext[type]) != 0)
-                        LOGE("Input file is not a supported type!\n");
-
-                    // Strip out extension and remove input
-                    *ext = '\0';
-                    rm_in = true;
-                    fprintf(stderr, "Decompressing to [%s]\n", outfile);
-                }
-            }
+    if (map.sz() == 0) {
+        len = fread(buf.buf(), 1, buf.sz(), in_fp);
+    } else {
+        len = map.sz();
+    }
+    if (len == 0) {
+        fclose(in_fp);
+        return;
+    }
+    const uint8_t *in = map.sz() == 0 ? buf.buf() : map.buf();
+    format_t type = check_fmt(in, len);
 
-            FILE *out_fp = outfile == "-"sv ? stdout : xfopen(outfile, "we");
-            strm = get_decoder(type, make_unique<fp_channel>(out_fp));
-            if (ext) *ext = '.';
+    fprintf(stderr, "Detected format: [%s]\n", fmt2name[type]);
+
+    if (!COMPRESSED(type))
+        LOGE("Input file is not a supported compressed type!\n");
+
+    /* If user does not provide outfile, infile has to be either
+    * <path>.[ext], or '-'. Outfile will be either <path> or '-'.
+    * If the input does not have proper format, abort */
+
+    char *ext = nullptr;
+    if (outfile == nullptr) {
+        outfile = infile;
+        if (!in_std) {
+            ext = strrchr(infile, '.');
+            if (ext == nullptr || strcmp(ext, fmt2ext[type]) != 0)
+                LOGE("Input file is not a supported type!\n");
+
+            // Strip out extension and remove input
+            *ext = '\0';
+            rm_in = true;
+            fprintf(stderr, "Decompressing to [%s]\n", outfile);
         }
-        if (!strm->write(buf, len))
+    }
+
+    int out_fd = open_output(outfile);
+    if (ext) *ext = '.';
+
+    if (map.sz() != 0) {
+        if (!decompress(type, map, out_fd))
             LOGE("Decompression error!\n");
+    } else {
+        auto strm = get_decoder(type, make_unique<fd_channel>(out_fd));
+        do {
+            if (!strm->write(buf.buf(), len))
+                LOGE("Decompression error!\n");
+        } while ((len = fread(buf.buf(), 1, buf.sz(), in_fp)));
     }
 
-    strm.reset(nullptr);
+    if (out_fd != STDOUT_FILENO)
+        close(out_fd);
     fclose(in_fp);
 
     if (rm_in)
         unlink(infile);
 }
 
-void compress(const char *method, const char *infile, const char *outfile) {
+void compress(const char *method, const char *infile, const char *outfile,
+              const encoder_opts &opts) {
     format_t fmt = name2fmt[method];
     if (fmt == UNKNOWN)
         LOGE("Unknown compression method: [%s]\n", method);
@@ -684,34 +1439,46 @@ void compress(const char *method, const char *infile, const char *outfile) {
     bool rm_in = false;
 
     FILE *in_fp = in_std ? stdin : xfopen(infile, "re");
-    FILE *out_fp;
+    int out_fd;
 
     if (outfile == nullptr) {
         if (in_std) {
-            out_fp = stdout;
+            out_fd = STDOUT_FILENO;
         } else {
             /* If user does not provide outfile and infile is not
              * STDIN, output to <infile>.[ext] */
             string tmp(infile);
             tmp += fmt2ext[fmt];
-            out_fp = xfopen(tmp.data(), "we");
+            out_fd = open_output(tmp.data());
             fprintf(stderr, "Compressing to [%s]\n", tmp.data());
             rm_in = true;
         }
     } else {
-        out_fp = outfile == "-"sv ? stdout : xfopen(outfile, "we");
+        out_fd = open_output(outfile);
     }
 
-    auto strm = get_encoder(fmt, make_unique<fp_channel>(out_fp));
+    {
+        auto strm = get_encoder(fmt, make_unique<fd_channel>(out_fd), opts);
 
-    char buf[4096];
-    size_t len;
-    while ((len = fread(buf, 1, sizeof(buf), in_fp))) {
-        if (!strm->write(buf, len))
-            LOGE("Compression error!\n");
+        mmap_data map = map_input(in_fp);
+        if (map.sz() != 0) {
+            madvise(map.buf(), map.sz(), MADV_SEQUENTIAL);
+            for (size_t off = 0; off < map.sz(); off += IO_BUF_SZ) {
+                if (!strm->write(map.buf() + off, std::min(IO_BUF_SZ, map.sz() - off)))
+                    LOGE("Compression error!\n");
+            }
+        } else {
+            heap_data buf(IO_BUF_SZ);
+            size_t len;
+            while ((len = fread(buf.buf(), 1, buf.sz(), in_fp))) {
+                if (!strm->write(buf.buf(), len))
+                    LOGE("Compression error!\n");
+            }
+        }
     }
 
-    strm.reset(nullptr);
+    if (out_fd != STDOUT_FILENO)
+        close(out_fd);
     fclose(in_fp);
 
     if (rm_in)
@@ -726,9 +1493,30 @@ bool decompress(rust::Slice<const uint8_t> buf, int fd) {
         return false;
     }
 
-    auto strm = get_decoder(type, make_unique<fd_channel>(fd));
-    if (!strm->write(buf.data(), buf.length())) {
+    return decompress(type, byte_view(buf.data(), buf.length()), fd);
+}
+
+// Appends the decoded data to a buffer owned by Rust
+class sink_stream : public out_stream {
+public:
+    explicit sink_stream(BufSink &out) : out(out) {}
+
+    bool write(const void *buf, size_t len) override {
+        out.extend(rust::Slice<const uint8_t>(static_cast<const uint8_t *>(buf), len));
+        return true;
+    }
+
+private:
+    BufSink &out;
+};
+
+bool decompress_to(rust::Slice<const uint8_t> buf, BufSink &out) {
+    format_t type = check_fmt(buf.data(), buf.length());
+
+    if (!COMPRESSED(type)) {
+        LOGE("Input is not a supported compression format!\n");
         return false;
     }
-    return true;
+
+    return decompress(type, byte_view(buf.data(), buf.length()), make_unique<sink_stream>(out));
 }
@@ -5,8 +5,36 @@
 
 #include "format.hpp"
 
-out_strm_ptr get_encoder(format_t type, out_strm_ptr &&base);
+struct BufSink;
+
+struct encoder_opts {
+    // Compression level, -1 for the highest level of the format
+    int level = -1;
+    // Maximum number of threads, 0 to use max_threads()
+    int threads = 0;
+    // zlib strategy for gzip, -1 for Z_DEFAULT_STRATEGY
+    int strategy = -1;
+    // Base two logarithm of the gzip window size (9 - 15), 0 for 15
+    int window = 0;
+    // Split gzip, zopfli and xz input into independently compressed blocks, which are
+    // compressed in parallel. The output differs from the default single stream, so it
+    // is opt-in.
+    bool blocks = false;
+    // Size of each independently compressed block, 0 for default
+    size_t block_size = 0;
+};
+
+out_strm_ptr get_encoder(format_t type, out_strm_ptr &&base, const encoder_opts &opts = {});
 out_strm_ptr get_decoder(format_t type, out_strm_ptr &&base);
-void compress(const char *method, const char *infile, const char *outfile);
+// Decompress a complete in-memory buffer. LZ4 frame and legacy streams are
+// indexed upfront and their independent blocks are decoded in parallel on at
+// most threads threads, 0 to use max_threads().
+bool decompress(format_t type, byte_view in, out_strm_ptr &&base, int threads = 0);
+// Same as above, but for formats whose decompressed size is known upfront, the output
+// is decoded straight into a memory mapping of the file behind fd.
+bool decompress(format_t type, byte_view in, int fd);
+void compress(const char *method, const char *infile, const char *outfile,
+              const encoder_opts &opts = {});
 void decompress(char *infile, const char *outfile);
 bool decompress(rust::Slice<const uint8_t> buf, int fd);
+bool decompress_to(rust::Slice<const uint8_t> buf, BufSink &out);
@@ -199,10 +199,12 @@ struct CpioHeader {
     check: [u8; 8],
 }
 
+#[derive(Clone)]
 pub(crate) struct Cpio {
     pub(crate) entries: BTreeMap<String, Box<CpioEntry>>,
 }
 
+#[derive(Clone)]
 pub(crate) struct CpioEntry {
     pub(crate) mode: mode_t,
     pub(crate) uid: uid_t,
@@ -213,13 +215,13 @@ pub(crate) struct CpioEntry {
 }
 
 impl Cpio {
-    fn new() -> Self {
+    pub(crate) fn new() -> Self {
         Self {
             entries: BTreeMap::new(),
         }
     }
 
-    fn load_from_data(data: &[u8]) -> LoggedResult<Self> {
+    pub(crate) fn load_from_data(data: &[u8]) -> LoggedResult<Self> {
         let mut cpio = Cpio::new();
         let mut pos = 0usize;
         while pos < data.len() {
@@ -268,6 +270,10 @@ impl Cpio {
     fn dump(&self, path: &str) -> LoggedResult<()> {
         eprintln!("Dumping cpio: [{}]", path);
         let mut file = File::create(path)?;
+        self.write_to(&mut file)
+    }
+
+    pub(crate) fn write_to<W: Write>(&self, file: &mut W) -> LoggedResult<()> {
         let mut pos = 0usize;
         let mut inode = 300000i64;
         for (name, entry) in &self.entries {
@@ -394,23 +400,20 @@ impl Cpio {
             return Err(log_err!("path cannot end with / for add"));
         }
         let file = Path::new(file);
-        let content = read(file)?;
         let metadata = metadata(file)?;
-        let mut rdevmajor: dev_t = 0;
-        let mut rdevminor: dev_t = 0;
-        let mode = if metadata.file_type().is_file() {
-            mode | S_IFREG
+        if metadata.file_type().is_file() {
+            self.add_data(mode, path, read(file)?);
+            return Ok(());
+        }
+        let mode = if metadata.file_type().is_block_device() {
+            mode | S_IFBLK
+        } else if metadata.file_type().is_char_device() {
+            mode | S_IFCHR
         } else {
-            rdevmajor = unsafe { major(metadata.rdev().try_into()?).try_into()? };
-            rdevminor = unsafe { minor(metadata.rdev().try_into()?).try_into()? };
-            if metadata.file_type().is_block_device() {
-                mode | S_IFBLK
-            } else if metadata.file_type().is_char_device() {
-                mode | S_IFCHR
-            } else {
-                return Err(log_err!("unsupported file type"));
-            }
+            return Err(log_err!("unsupported file type"));
         };
+        let rdevmajor: dev_t = unsafe { major(metadata.rdev().try_into()?).try_into()? };
+        let rdevminor: dev_t = unsafe { minor(metadata.rdev().try_into()?).try_into()? };
         self.entries.insert(
             norm_path(path),
             Box::new(CpioEntry {
@@ -419,14 +422,30 @@ impl Cpio {
                 gid: 0,
                 rdevmajor,
                 rdevminor,
-                data: content,
+                data: vec![],
             }),
         );
         eprintln!("Add file [{}] ({:04o})", path, mode);
         Ok(())
     }
 
-    fn mkdir(&mut self, mode: &mode_t, dir: &str) {
+    pub(crate) fn add_data(&mut self, mode: &mode_t, path: &str, data: Vec<u8>) {
+        let mode = mode | S_IFREG;
+        self.entries.insert(
+            norm_path(path),
+            Box::new(CpioEntry {
+                mode,
+                uid: 0,
+                gid: 0,
+                rdevmajor: 0,
+                rdevminor: 0,
+                data,
+            }),
+        );
+        eprintln!("Add file [{}] ({:04o})", path, mode);
+    }
+
+    pub(crate) fn mkdir(&mut self, mode: &mode_t, dir: &str) {
         self.entries.insert(
             norm_path(dir),
             Box::new(CpioEntry {
@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <bitset>
 #include <vector>
 #include <map>
@@ -9,6 +10,7 @@
 #include "dtb.hpp"
 #include "format.hpp"
 #include "boot-rs.hpp"
+#include "parallel.hpp"
 
 using namespace std;
 
@@ -94,75 +96,152 @@ static int find_fstab(const void *fdt, int node = 0) {
     return -1;
 }
 
-template<typename Func>
-static void for_each_fdt(const char *file, bool rw, Func fn) {
-    mmap_data m(file, rw);
-    uint8_t *end = m.buf() + m.sz();
-    for (uint8_t *fdt = m.buf(); fdt < end;) {
-        fdt = static_cast<uint8_t*>(memmem(fdt, end - fdt, DTB_MAGIC, sizeof(fdt32_t)));
+// Whether a valid flattened device tree starts at fdt, with avail bytes of buffer left
+static bool fdt_valid(const uint8_t *fdt, size_t avail) {
+    if (avail < sizeof(fdt_header) || !BUFFER_MATCH(fdt, DTB_MAGIC))
+        return false;
+    auto hdr = reinterpret_cast<const fdt_header *>(fdt);
+    uint32_t totalsize = fdt32_to_cpu(hdr->totalsize);
+    uint32_t off_dt_struct = fdt32_to_cpu(hdr->off_dt_struct);
+    if (totalsize > avail || off_dt_struct >= totalsize ||
+        totalsize - off_dt_struct < sizeof(fdt_node_header))
+        return false;
+    // The first node has to be the root node
+    auto node = reinterpret_cast<const fdt_node_header *>(fdt + off_dt_struct);
+    return fdt32_to_cpu(node->tag) == FDT_BEGIN_NODE;
+}
+
+// DTB/DTBO partition images list the offsets of all their entries in a table
+static bool dt_table_index(const uint8_t *buf, size_t sz, size_t max, vector<size_t> &index) {
+    if (sz < sizeof(dt_table_header) || !BUFFER_MATCH(buf, DT_TABLE_MAGIC))
+        return false;
+    auto hdr = reinterpret_cast<const dt_table_header *>(buf);
+    uint64_t num = fdt32_to_cpu(hdr->num_dtbs);
+    uint64_t ent_off = fdt32_to_cpu(hdr->dt_entries_offset);
+    uint64_t ent_sz = fdt32_to_cpu(hdr->dt_entry_size);
+    if (ent_sz < sizeof(dt_table_entry) || ent_off + num * ent_sz > sz)
+        return false;
+    for (uint64_t i = 0; i < num; ++i) {
+        auto e = reinterpret_cast<const dt_table_entry *>(buf + ent_off + i * ent_sz);
+        uint32_t off = fdt32_to_cpu(e->offset);
+        if (off >= sz || !fdt_valid(buf + off, sz - off))
+            return false;
+        index.push_back(off);
+    }
+    // Entries may share the same blob, but blobs must not overlap
+    sort(index.begin(), index.end());
+    index.erase(unique(index.begin(), index.end()), index.end());
+    for (size_t i = 1; i < index.size(); ++i) {
+        if (index[i - 1] + fdt_totalsize(buf + index[i - 1]) > index[i]) {
+            index.clear();
+            return false;
+        }
+    }
+    if (index.size() > max)
+        index.resize(max);
+    return true;
+}
+
+vector<size_t> fdt_index(byte_view data, size_t max) {
+    vector<size_t> index;
+    const uint8_t *buf = data.buf();
+    if (dt_table_index(buf, data.sz(), max, index))
+        return index;
+    const uint8_t *end = buf + data.sz();
+    for (const uint8_t *fdt = buf; fdt < end && index.size() < max;) {
+        fdt = static_cast<const uint8_t *>(memmem(fdt, end - fdt, DTB_MAGIC, sizeof(fdt32_t)));
         if (fdt == nullptr)
             break;
-        fn(fdt);
-        fdt += fdt_totalsize(fdt);
+        if (fdt_valid(fdt, end - fdt)) {
+            index.push_back(fdt - buf);
+            fdt += fdt_totalsize(fdt);
+        } else {
+            fdt += sizeof(fdt32_t);
+        }
     }
+    return index;
 }
 
 static void dtb_print(const char *file, bool fstab) {
     fprintf(stderr, "Loading dtbs from [%s]\n", file);
-    int dtb_num = 0;
-    for_each_fdt(file, false, [&](uint8_t *fdt) {
+    mmap_data m(file);
+    auto index = fdt_index(m);
+    for (size_t dtb_num = 0; dtb_num < index.size(); ++dtb_num) {
+        const uint8_t *fdt = m.buf() + index[dtb_num];
         if (fstab) {
             if (int node = find_fstab(fdt); node >= 0) {
-                fprintf(stderr, "Found fstab in dtb.%04d\n", dtb_num);
+                fprintf(stderr, "Found fstab in dtb.%04zu\n", dtb_num);
                 print_node(fdt, node);
             }
         } else {
-            fprintf(stderr, "Printing dtb.%04d\n", dtb_num);
+            fprintf(stderr, "Printing dtb.%04zu\n", dtb_num);
             print_node(fdt);
         }
-        ++dtb_num;
-    });
+    }
     fprintf(stderr, "\n");
 }
 
-static bool dtb_patch(const char *file) {
-    fprintf(stderr, "Loading dtbs from [%s]\n", file);
-
-    bool keep_verity = check_env("KEEPVERITY");
+// Messages are appended to log instead of printed, as blobs are patched concurrently
+static bool fdt_patch_inplace(uint8_t *fdt, bool keep_verity, string &log) {
     bool patched = false;
-    for_each_fdt(file, true, [&](uint8_t *fdt) {
-        int node;
-        // Patch the chosen node for bootargs
-        fdt_for_each_subnode(node, fdt, 0) {
-            if (auto name = fdt_get_name(fdt, node, nullptr); !name || name != "chosen"sv)
-                continue;
-            int len;
-            if (auto value = fdt_getprop(fdt, node, "bootargs", &len)) {
-                if (void *skip = memmem(value, len, "skip_initramfs", 14)) {
-                    fprintf(stderr, "Patch [skip_initramfs] -> [want_initramfs]\n");
-                    memcpy(skip, "want", 4);
-                    patched = true;
-                }
+    int node;
+    // Patch the chosen node for bootargs
+    fdt_for_each_subnode(node, fdt, 0) {
+        if (auto name = fdt_get_name(fdt, node, nullptr); !name || name != "chosen"sv)
+            continue;
+        int len;
+        if (auto value = fdt_getprop(fdt, node, "bootargs", &len)) {
+            if (void *skip = memmem(value, len, "skip_initramfs", 14)) {
+                log += "Patch [skip_initramfs] -> [want_initramfs]\n";
+                memcpy(skip, "want", 4);
+                patched = true;
             }
-            break;
         }
-        if (!keep_verity) {
-            if (int fstab = find_fstab(fdt); fstab >= 0) {
-                fdt_for_each_subnode(node, fdt, fstab) {
-                    int len;
-                    char *value = (char *) fdt_getprop(fdt, node, "fsmgr_flags", &len);
-                    byte_data data(value, len);
-                    patched |= (patch_verity(data) != len);
-                }
+        break;
+    }
+    if (!keep_verity) {
+        if (int fstab = find_fstab(fdt); fstab >= 0) {
+            rust::String removed;
+            fdt_for_each_subnode(node, fdt, fstab) {
+                int len;
+                char *value = (char *) fdt_getprop(fdt, node, "fsmgr_flags", &len);
+                byte_data data(value, len);
+                patched |= (patch_verity_log(data, removed) != len);
             }
+            log += string(removed);
         }
-    });
+    }
     return patched;
 }
 
-[[noreturn]]
-static void dtb_test(const char *file) {
-    for_each_fdt(file, false, [&](uint8_t *fdt) {
+bool dtb_patch(const char *name, byte_data dtb, const vector<size_t> &index) {
+    fprintf(stderr, "Loading dtbs from [%s]\n", name);
+
+    // Blobs never overlap and are patched in place, so all of them can be patched at once
+    bool keep_verity = check_env("KEEPVERITY");
+    vector<uint8_t> patched(index.size());
+    vector<string> logs(index.size());
+    parallel_for(index.size(), [&](size_t i) {
+        patched[i] = fdt_patch_inplace(dtb.buf() + index[i], keep_verity, logs[i]);
+    });
+    for (auto &log : logs)
+        fputs(log.data(), stderr);
+    return find(patched.begin(), patched.end(), true) != patched.end();
+}
+
+bool dtb_patch(const char *name, byte_data dtb) {
+    return dtb_patch(name, dtb, fdt_index(dtb));
+}
+
+static bool dtb_patch(const char *file) {
+    mmap_data m(file, true);
+    return dtb_patch(file, m);
+}
+
+bool dtb_test(byte_data dtb, const vector<size_t> &index) {
+    bool ok = true;
+    for (size_t off : index) {
+        const uint8_t *fdt = dtb.buf() + off;
         // Find the system node in fstab
         if (int fstab = find_fstab(fdt); fstab >= 0) {
             int node;
@@ -173,13 +252,23 @@ static void dtb_test(const char *file) {
                 if (auto value = fdt_getprop(fdt, node, "mnt_point", &len)) {
                     // If mnt_point is set to /system_root, abort!
                     if (strncmp(static_cast<const char *>(value), "/system_root", len) == 0) {
-                        exit(1);
+                        ok = false;
                     }
                 }
             }
         }
-    });
-    exit(0);
+    }
+    return ok;
+}
+
+bool dtb_test(byte_data dtb) {
+    return dtb_test(dtb, fdt_index(dtb));
+}
+
+[[noreturn]]
+static void dtb_test(const char *file) {
+    mmap_data m(file);
+    exit(dtb_test(m) ? 0 : 1);
 }
 
 int dtb_commands(int argc, char *argv[]) {
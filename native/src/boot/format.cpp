@@ -43,6 +43,32 @@ format_t check_fmt(const void *buf, size_t len) {
     }
 }
 
+magic_scanner::magic_scanner(const void *buf, size_t len, std::string_view first_bytes)
+: end(static_cast<const uint8_t *>(buf) + len), num(0) {
+    for (char c : first_bytes) {
+        if (num == MAX_BYTES)
+            break;
+        bytes[num] = c;
+        // Not searched yet
+        found[num] = nullptr;
+        ++num;
+    }
+}
+
+const uint8_t *magic_scanner::next(const uint8_t *pos) {
+    const uint8_t *min = end;
+    for (int i = 0; i < num; ++i) {
+        // Only search again if the cached hit is behind pos
+        if (found[i] != end && (found[i] == nullptr || found[i] < pos)) {
+            auto p = pos < end ? memchr(pos, bytes[i], end - pos) : nullptr;
+            found[i] = p ? static_cast<const uint8_t *>(p) : end;
+        }
+        if (found[i] < min)
+            min = found[i];
+    }
+    return min == end ? nullptr : min;
+}
+
 const char *Fmt2Name::operator[](format_t fmt) {
     switch (fmt) {
         case GZIP:
@@ -81,6 +81,24 @@ public:
 
 format_t check_fmt(const void *buf, size_t len);
 
+// Finds offsets in a buffer that start with any of a small set of bytes, typically
+// the first bytes of the magics being searched for. Each byte is located with memchr,
+// so large regions without candidates are skipped at memchr speed instead of
+// running check_fmt() at every single offset.
+class magic_scanner {
+public:
+    magic_scanner(const void *buf, size_t len, std::string_view first_bytes);
+    // Returns the first candidate at or after pos, or nullptr if there is none
+    const uint8_t *next(const uint8_t *pos);
+
+private:
+    static constexpr int MAX_BYTES = 8;
+    const uint8_t *end;
+    uint8_t bytes[MAX_BYTES];
+    const uint8_t *found[MAX_BYTES];
+    int num;
+};
+
 extern Name2Fmt name2fmt;
 extern Fmt2Name fmt2name;
 extern Fmt2Ext fmt2ext;
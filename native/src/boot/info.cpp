@@ -0,0 +1,155 @@
+#include <cinttypes>
+#include <iterator>
+
+#include <base.hpp>
+
+#include "bootimg.hpp"
+#include "magiskboot.hpp"
+
+using namespace std;
+
+static void usage() {
+    fprintf(stderr,
+R"EOF(info [--json] [--formats] <bootimg>...
+  Parse only the header and the AVB footer of each boot image, without
+  reading any data of kernel, ramdisk or other blocks.
+  --json     print one JSON object per image to stdout
+  --formats  also detect the format of kernel, ramdisk and extra, which
+             reads the first page of each of them
+)EOF");
+    exit(1);
+}
+
+static const char *flag_names[] = {
+    "mtk_kernel", "mtk_ramdisk", "chromeos", "dhtb", "seandroid", "lg_bump", "sha256",
+    "blob", "nookhd", "acclaim", "amonet", "avb1_signed", "avb", "zimage_kernel",
+};
+static_assert(size(flag_names) == BOOT_FLAGS_MAX);
+
+// Fixed size char array that may not be null terminated
+static string fixed_str(const char *s, size_t max) {
+    return s ? string(s, strnlen(s, max)) : string();
+}
+
+static string info_json(const char *image, const boot_img &boot, bool formats) {
+    auto hdr = boot.hdr;
+    auto base = boot.map.buf();
+    char buf[128];
+
+    string r = "{\"image\":" + json_str(image) + ",\"ok\":true";
+    r += ",\"size\":" + to_string(boot.map.sz());
+    r += ",\"vendor\":";
+    r += hdr->is_vendor() ? "true" : "false";
+    r += ",\"header_version\":" + to_string(hdr->header_version());
+    r += ",\"page_size\":" + to_string(hdr->page_size());
+    if (uint32_t os_ver = hdr->os_version()) {
+        int version = os_ver >> 11;
+        int patch_level = os_ver & 0x7ff;
+        ssprintf(buf, sizeof(buf), ",\"os_version\":\"%d.%d.%d\",\"os_patch_level\":\"%d-%02d\"",
+                 (version >> 14) & 0x7f, (version >> 7) & 0x7f, version & 0x7f,
+                 (patch_level >> 4) + 2000, patch_level & 0xf);
+        r += buf;
+    }
+    if (const char *n = hdr->name())
+        r += ",\"name\":" + json_str(fixed_str(n, BOOT_NAME_SIZE));
+    r += ",\"cmdline\":" + json_str(fixed_str(hdr->cmdline(), BOOT_ARGS_SIZE) +
+                                     fixed_str(hdr->extra_cmdline(), BOOT_EXTRA_ARGS_SIZE));
+    if (const char *id = hdr->id()) {
+        r += ",\"id\":\"";
+        int len = boot.flags[SHA256_FLAG] ? SHA256_DIGEST_SIZE : SHA_DIGEST_SIZE;
+        for (int i = 0; i < len; ++i) {
+            ssprintf(buf, sizeof(buf), "%02hhx", id[i]);
+            r += buf;
+        }
+        r += "\"";
+    }
+
+    r += ",\"flags\":[";
+    bool first = true;
+    for (int i = 0; i < BOOT_FLAGS_MAX; ++i) {
+        if (boot.flags[i]) {
+            r += first ? "\"" : ",\"";
+            r += flag_names[i];
+            r += "\"";
+            first = false;
+        }
+    }
+
+    r += "],\"blocks\":[";
+    first = true;
+    auto block = [&](const char *name, const uint8_t *addr, uint32_t size, bool fmt) {
+        if (size == 0)
+            return;
+        ssprintf(buf, sizeof(buf), "%s{\"name\":\"%s\",\"offset\":%td,\"size\":%u",
+                 first ? "" : ",", name, addr - base, size);
+        r += buf;
+        if (formats && fmt) {
+            // Block data is not mapped readable, pread its first page only
+            uint8_t page[4096];
+            ssize_t len = pread(boot.fd, page, std::min<size_t>(size, sizeof(page)), addr - base);
+            r += ",\"format\":\"";
+            r += fmt2name[len > 0 ? check_fmt(page, len) : UNKNOWN];
+            r += "\"";
+        }
+        r += "}";
+        first = false;
+    };
+    block("kernel", boot.kernel, hdr->kernel_size(), true);
+    // Multiple ramdisks in v4 vendor boot
+    block("ramdisk", boot.ramdisk, hdr->ramdisk_size(),
+          !hdr->is_vendor() || hdr->header_version() < 4);
+    block("second", boot.second, hdr->second_size(), false);
+    block("extra", boot.extra, hdr->extra_size(), true);
+    block("recovery_dtbo", boot.recovery_dtbo, hdr->recovery_dtbo_size(), false);
+    block("dtb", boot.dtb, hdr->dtb_size(), false);
+    r += "]";
+
+    r += ",\"tail_size\":" + to_string(boot.tail.sz());
+    if (boot.flags[AVB_FLAG]) {
+        ssprintf(buf, sizeof(buf),
+                 ",\"avb\":{\"original_image_size\":%" PRIu64 ",\"vbmeta_offset\":%" PRIu64
+                 ",\"vbmeta_size\":%" PRIu64 "}",
+                 __builtin_bswap64(boot.avb_footer->original_image_size),
+                 __builtin_bswap64(boot.avb_footer->vbmeta_offset),
+                 __builtin_bswap64(boot.avb_footer->vbmeta_size));
+        r += buf;
+    }
+    r += "}\n";
+    return r;
+}
+
+int info_commands(int argc, char *argv[]) {
+    bool json = false;
+    bool formats = false;
+
+    int idx = 1;
+    for (; idx < argc && argv[idx][0] == '-'; ++idx) {
+        if (argv[idx] == "--json"sv)
+            json = true;
+        else if (argv[idx] == "--formats"sv)
+            formats = true;
+        else
+            usage();
+    }
+    if (idx == argc)
+        usage();
+
+    int ret = 0;
+    for (; idx < argc; ++idx) {
+        if (access(argv[idx], R_OK) != 0) {
+            fprintf(stderr, "Cannot open [%s]\n", argv[idx]);
+            ret = 1;
+            continue;
+        }
+        const boot_img boot(argv[idx], false, true);
+        if (!boot.hdr) {
+            ret = 1;
+            if (json)
+                printf("{\"image\":%s,\"ok\":false}\n", json_str(argv[idx]).data());
+            continue;
+        }
+        if (json)
+            fputs(info_json(argv[idx], boot, formats).data(), stdout);
+    }
+    return ret;
+}
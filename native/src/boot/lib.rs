@@ -2,11 +2,16 @@
 #![feature(btree_extract_if)]
 
 pub use base;
+use avb::{update_avb_hashes, verify_avb_hashes};
+use bspatch::BufSink;
 use cpio::cpio_commands;
-use patch::{hexpatch, patch_encryption, patch_verity};
+use patch::{hexpatch, hexpatch_buf, patch_encryption, patch_verity, patch_verity_log};
 use payload::extract_boot_from_payload;
+use ramdisk::patch_ramdisk;
 use sign::{get_sha, sha1_hash, sha256_hash, sign_boot_image, verify_boot_image, SHA};
 
+mod avb;
+mod bspatch;
 mod cpio;
 mod patch;
 mod payload;
@@ -21,6 +26,13 @@ pub mod ffi {
     unsafe extern "C++" {
         include!("compress.hpp");
         fn decompress(buf: &[u8], fd: i32) -> bool;
+        fn decompress_to(buf: &[u8], out: &mut BufSink) -> bool;
+
+        include!("parallel.hpp");
+        fn max_threads() -> i32;
+
+        include!("magiskboot.hpp");
+        fn parse_size(s: &[u8]) -> usize;
 
         include!("bootimg.hpp");
         #[cxx_name = "boot_img"]
@@ -32,6 +44,9 @@ pub mod ffi {
     }
 
     extern "Rust" {
+        type BufSink;
+        fn extend(self: &mut BufSink, data: &[u8]);
+
         type SHA;
         fn get_sha(use_sha1: bool) -> Box<SHA>;
         fn update(self: &mut SHA, data: &[u8]);
@@ -41,8 +56,12 @@ pub mod ffi {
         fn sha256_hash(data: &[u8], out: &mut [u8]);
 
         fn hexpatch(file: &[u8], from: &[u8], to: &[u8]) -> bool;
+        fn hexpatch_buf(buf: &mut [u8], from: &[u8], to: &[u8]) -> bool;
         fn patch_encryption(buf: &mut [u8]) -> usize;
         fn patch_verity(buf: &mut [u8]) -> usize;
+        fn patch_verity_log(buf: &mut [u8], log: &mut String) -> usize;
+        fn update_avb_hashes(image: &[u8], vbmeta: &mut [u8], partition: &str);
+        fn verify_avb_hashes(image: &[u8], vbmeta: &[u8], partition: &str) -> bool;
     }
 
     #[namespace = "rust"]
@@ -54,6 +73,14 @@ pub mod ffi {
         ) -> bool;
 
         unsafe fn cpio_commands(argc: i32, argv: *const *const c_char) -> bool;
+        fn patch_ramdisk(
+            image: &[u8],
+            ramdisk: &[u8],
+            magiskinit: &[u8],
+            magisk32_xz: &[u8],
+            magisk64_xz: &[u8],
+            stub_xz: &[u8],
+        ) -> Vec<u8>;
         unsafe fn verify_boot_image(img: &BootImage, cert: *const c_char) -> bool;
         unsafe fn sign_boot_image(
             payload: &[u8],
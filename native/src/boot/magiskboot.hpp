@@ -1,9 +1,12 @@
 #pragma once
 
 #include <sys/types.h>
+#include <vector>
 
 #include <base.hpp>
 
+#include "format.hpp"
+
 #define HEADER_FILE     "header"
 #define KERNEL_FILE     "kernel"
 #define RAMDISK_FILE    "ramdisk.cpio"
@@ -14,12 +17,117 @@
 #define DTB_FILE        "dtb"
 #define NEW_BOOT        "new-boot.img"
 
+// How repack chooses the compression of kernel, ramdisk and extra
+enum class comp_select {
+    // Reuse the formats detected in the original image
+    ORIGINAL,
+    // Compress with all candidates in parallel and use the smallest output
+    SMALLEST,
+    // Use the candidates of the fastest formats and levels with which the image still
+    // fits in the size of the original image
+    FIT,
+};
+
+struct repack_opts {
+    bool skip_comp = false;
+    comp_select select = comp_select::ORIGINAL;
+    // Formats allowed as candidates in addition to the ones compatible with the
+    // original format. Only list formats the bootloader and kernel can decompress.
+    std::vector<format_t> formats;
+    // Directory to cache compressed components in, keyed by the SHA-256 of the
+    // uncompressed data, the format and the encoder options. nullptr to disable.
+    const char *cache_dir = nullptr;
+    // Convert the output to an Android sparse image
+    bool sparse = false;
+    // Maximum number of threads each component is compressed with, 0 for max_threads()
+    int threads = 0;
+};
+
+// A boot image component held in memory, in place of its file in the current directory
+struct boot_part {
+    // Whether the component is present, the same as its file existing after unpack
+    bool exists = false;
+    byte_view data;
+    // Owns data when it is not a view of another buffer
+    heap_data buf;
+    mmap_data map;
+
+    void set(byte_view d) {
+        exists = true;
+        data = d;
+    }
+    void set(heap_data &&d) {
+        exists = true;
+        buf = std::move(d);
+        data = buf;
+    }
+    void set(mmap_data &&d) {
+        exists = true;
+        map = std::move(d);
+        data = map;
+    }
+    // Make data writable, copying it into buf first if it is a view of another buffer
+    byte_data writable() {
+        if (data.buf() != buf.buf())
+            set(data.clone());
+        return buf;
+    }
+};
+
+struct boot_parts {
+    boot_part kernel;
+    boot_part kernel_dtb;
+    boot_part ramdisk;
+    boot_part second;
+    boot_part extra;
+    boot_part recovery_dtbo;
+    boot_part dtb;
+    // File to load header configurations from, nullptr for none
+    const char *header_file = nullptr;
+};
+
+struct boot_img;
+
 int unpack(const char *image, bool skip_decomp = false, bool hdr = false);
-void repack(const char *src_img, const char *out_img, bool skip_comp = false);
+// Same as unpack without any flags, but the components are decompressed into memory.
+// Each component is decompressed with at most threads threads, 0 for max_threads().
+// Returns false if any component failed to decompress.
+bool unpack(const boot_img &boot, boot_parts &parts, int threads = 0);
+void repack(const char *src_img, const char *out_img, const repack_opts &opts = {});
+// Same as repack, but the components are taken from parts instead of the current directory.
+// Returns false if the image could not be written, which only happens without ExitOnError.
+bool repack(const boot_img &boot, const boot_parts &parts, const char *out_img,
+            const repack_opts &opts = {});
+// Load the component files found in the directory dirfd, or write them all to it
+void load_parts(int dirfd, boot_parts &parts);
+bool dump_parts(int dirfd, const boot_parts &parts);
+int boot_patch(const char *image, const char *out_img);
+int boot_patch(const boot_img &boot, const char *out_img, int threads = 0);
 int verify(const char *image, const char *cert);
 int sign(const char *image, const char *name, const char *cert, const char *key);
 int split_image_dtb(const char *filename);
+// Convert the raw image file into an Android sparse image in place
+bool write_sparse(const char *file, uint32_t blk_sz = 4096);
 int dtb_commands(int argc, char *argv[]);
+// Offsets of the valid flattened device trees in data, at most max of them. Entries of
+// DTB/DTBO partition images are read from their table instead of searched for.
+std::vector<size_t> fdt_index(byte_view data, size_t max = SIZE_MAX);
+// In-memory versions of the dtb actions patch and test, name is only used in messages
+bool dtb_patch(const char *name, byte_data dtb);
+bool dtb_test(byte_data dtb);
+// Same as above, but with the index of dtb from fdt_index
+bool dtb_patch(const char *name, byte_data dtb, const std::vector<size_t> &index);
+bool dtb_test(byte_data dtb, const std::vector<size_t> &index);
+int bench_commands(int argc, char *argv[]);
+int batch_commands(int argc, char *argv[]);
+int info_commands(int argc, char *argv[]);
+// Quote and escape s as a JSON string
+std::string json_str(std::string_view s);
+// Parse sizes like "4096", "512K", "8M" or "1G", returns SIZE_MAX on error
+size_t parse_size(std::string_view s);
+static inline size_t parse_size(rust::Slice<const uint8_t> s) {
+    return parse_size(std::string_view(reinterpret_cast<const char *>(s.data()), s.size()));
+}
 
 static inline bool check_env(const char *name) {
     using namespace std::string_view_literals;
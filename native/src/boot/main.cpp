@@ -3,6 +3,7 @@
 #include "boot-rs.hpp"
 #include "magiskboot.hpp"
 #include "compress.hpp"
+#include "parallel.hpp"
 
 using namespace std;
 
@@ -16,7 +17,12 @@ static void usage(char *arg0) {
     fprintf(stderr,
 R"EOF(MagiskBoot - Boot Image Modification Tool
 
-Usage: %s <action> [args...]
+Usage: %s [--threads=N] <action> [args...]
+
+Global options:
+  --threads=N
+    Use at most N threads for operations that can run in parallel.
+    Defaults to the number of online CPUs.
 
 Supported actions:
   unpack [-n] [-h] <bootimg>
@@ -33,7 +39,7 @@ Supported actions:
     Return values:
     0:valid    1:error    2:chromeos
 
-  repack [-n] <origbootimg> [outbootimg]
+  repack [-n] [-s] [-c smallest|fit] [-f formats] <origbootimg> [outbootimg]
     Repack boot image components using files from the current directory
     to [outbootimg], or 'new-boot.img' if not specified.
     <origbootimg> is the original boot image used to unpack the components.
@@ -42,9 +48,58 @@ Supported actions:
     in the current directory is already compressed, then no addition
     compression will be performed for that specific component.
     If '-n' is provided, all compression operations will be skipped.
+    If '-s' is provided, [outbootimg] is written as an Android sparse
+    image, where runs of zero (or any repeated) blocks take no space.
+    If '-c smallest' is provided, each component is compressed with
+    several formats and levels in parallel, and the smallest output is
+    used. If '-c fit' is provided, the candidates of the faster formats
+    and lower levels are used instead, as long as [outbootimg] still
+    fits in the size of <origbootimg>. Components can grow into the
+    space freed by the others and into unused space at the end of
+    <origbootimg>, except for zImage kernels.
+    Candidates are the levels of the original format and compatible
+    formats (e.g. gzip and zopfli). Use '-f' with a comma separated list
+    to also try other formats, only if the bootloader and kernel support
+    them. The choice for each component is reported.
+    If env variable REPACKCACHEDIR is set to a directory, compressed
+    components are cached there, keyed by the SHA-256 of the uncompressed
+    data, the format and the encoder options. Unchanged components are
+    then copied from the cache instead of compressed again on later
+    repacks.
+    If the image has an AVB footer, the digest of its hash descriptor
+    (sha256 only) is regenerated for the new image. If vbmeta describes
+    several partitions, only the descriptor named after the image's own
+    partition (boot, init_boot or vendor_boot) is updated. A signed
+    vbmeta is not re-signed.
     If env variable PATCHVBMETAFLAG is set to true, all disable flags in
     the boot image's vbmeta header will be set.
 
+  info [--json] [--formats] <bootimg>...
+    Parse only the header, block offsets and AVB footer of each image,
+    without reading any data of kernel, ramdisk or other blocks, and
+    without verifying signatures. Header information is printed to
+    STDERR as in unpack. If '--json' is provided, one JSON object per
+    image with header fields, flags, block offsets and sizes, and AVB
+    footer fields is printed to STDOUT. If '--formats' is provided, the
+    formats of kernel, ramdisk and extra are also detected, which reads
+    the first page of each of them.
+    Return 1 if any image could not be parsed.
+
+  patch <bootimg> [outbootimg]
+    Patch <bootimg> for Magisk and write the result to [outbootimg], or
+    'new-boot.img' if not specified. This does the same as unpacking,
+    patching the ramdisk, dtbs and kernel like scripts/boot_patch.sh,
+    then repacking, but in a single process without intermediate files.
+    magiskinit, stub.apk and optionally magisk32 and magisk64 are
+    taken from the current directory. Unlike the script, it does not
+    dump NAND character devices, does not save stock_boot.img, does not
+    run magisk --preinit-device (set PREINITDEVICE instead), and does
+    not sign ChromeOS images.
+    Configure with env variables: KEEPVERITY, KEEPFORCEENCRYPT,
+    PATCHVBMETAFLAG, RECOVERYMODE, SYSTEM_ROOT, PREINITDEVICE, BOOTMODE
+    Return values:
+    0:valid    1:error    2:chromeos (the output still needs signing)
+
   verify <bootimg> [x509.pem]
     Check whether the boot image is signed with AVB 1.0 signature.
     Optionally provide a certificate to verify whether the image is
@@ -65,7 +120,24 @@ Supported actions:
     If [partition] is not specified, then attempt to extract either
     'init_boot' or 'boot'. Which partition was chosen can be determined
     by whichever 'init_boot.img' or 'boot.img' exists.
+    [partition] can also be a comma separated list of partitions, or
+    'all' for every partition in the payload. All of them are extracted
+    in a single pass over <payload.bin> into the directory [outfile]
+    (default: current directory) as '<partition>.img'.
     <payload.bin> can be '-' to be STDIN.
+    Delta (incremental) payloads are supported if env variable SOURCEDIR
+    is set to a directory containing the source images of the updated
+    partitions as '<partition>.img'. Source data is verified against the
+    hashes in the payload. Payloads using brotli compressed bsdiff patches,
+    puffdiff or zucchini operations are rejected before anything is written.
+    Operations are executed by a pool of worker threads while the data
+    is being read. If env variable EXTRACTBUFSIZE is set, at most that
+    much operation data (K, M or G suffix allowed) is read ahead of the
+    workers (default: 64M).
+    If env variable EXTRACTVERIFY is set to true, the data of each
+    operation and each extracted image are verified against the SHA-256
+    hashes in the payload. Images are hashed while being extracted. An
+    image that does not match is renamed to '<image>.bad'.
 
   hexpatch <file> <hexpattern1> <hexpattern2>
     Search <hexpattern1> in <file>, and replace it with <hexpattern2>
@@ -99,12 +171,50 @@ Supported actions:
   cleanup
     Cleanup the current working directory
 
-  compress[=format] <infile> [outfile]
+  bench [-n iterations] [-s size] [-l level] [-f formats] [-t threads]
+        [file...]
+    Measure the throughput of all compression formats, hexpatch, cpio
+    and boot image parsing over synthetic corpora and [file...].
+    Results are printed to STDOUT as one JSON object per line, with
+    MB/s, compression ratio and peak RSS of each operation.
+    '-n' sets the number of runs per measurement (default: 3), the
+    fastest run is reported. '-s' sets the size of each synthetic
+    corpus (default: 8M), use 0 to only measure [file...]. '-l' sets
+    the compression level, and '-f' takes a comma separated list of
+    formats to measure (default: all). '-t' takes a comma separated
+    list of thread counts to measure the formats with, using the block
+    encoders, to compare how they scale. Temporary files are created in
+    $TMPDIR (default: /tmp).
+
+  batch [-j jobs] [-d dir] [-o report] <manifest>
+    Process all boot images listed in <manifest> with a pool of worker
+    threads in a single process. Each line of <manifest> is
+    '<bootimg> <op>[,<op>...] [outbootimg]', where <op> is one of
+    unpack, verify, patch or repack, run in the given order. Empty
+    lines and lines starting with '#' are ignored. Each image gets its
+    own working directory '<dir>/<line number>' (default dir: batch),
+    and [outbootimg] defaults to new-boot.img in there.
+    'verify' reports the AVB 1.0 signature, and fails if the AVB hash
+    descriptor of the image does not match its contents.
+    '-j' sets the number of images processed at the same time
+    (default: number of CPUs); the threads are split evenly between
+    them. A JSON object with the result and per-stage timings of each
+    image is printed to STDOUT, or to [report] with '-o'.
+    A failed image does not stop the others. Return 1 if any image failed.
+
+  compress[=format] [-l level] [-b size] <infile> [outfile]
     Compress <infile> with [format] to [outfile].
     <infile>/[outfile] can be '-' to be STDIN/STDOUT.
     If [format] is not specified, then gzip will be used.
     If [outfile] is not specified, then <infile> will be replaced
     with another file suffixed with a matching file extension.
+    Use '-l' to set the compression level; by default the highest
+    level of each format is used (lz4 defaults to 9).
+    If '--threads' or '-b' is given, gzip, zopfli and xz split their
+    input into blocks that are compressed in parallel, otherwise a single
+    stream is produced. Use '-b' to set the block size in bytes, optionally
+    suffixed with K or M (default: 128K for gzip, 8M for xz). zopfli
+    always uses 1M blocks.
     Supported formats: )EOF", arg0);
 
     print_formats();
@@ -131,6 +241,18 @@ int main(int argc, char *argv[]) {
     if (argc < 2)
         usage(argv[0]);
 
+    if (str_starts(argv[1], "--threads=")) {
+        int threads = parse_int(argv[1] + 10);
+        if (threads <= 0)
+            usage(argv[0]);
+        set_max_threads(threads);
+        argv[1] = argv[0];
+        --argc;
+        ++argv;
+        if (argc < 2)
+            usage(argv[0]);
+    }
+
     // Skip '--' for backwards compatibility
     string_view action(argv[1]);
     if (str_starts(action, "--"))
@@ -178,13 +300,38 @@ int main(int argc, char *argv[]) {
         }
         return unpack(argv[idx], nodecomp, hdr);
     } else if (argc > 2 && action == "repack") {
-        if (argv[2] == "-n"sv) {
-            if (argc == 3)
+        repack_opts opts;
+        opts.cache_dir = getenv("REPACKCACHEDIR");
+        int idx = 2;
+        for (; idx < argc && argv[idx][0] == '-'; ++idx) {
+            if (argv[idx] == "-n"sv) {
+                opts.skip_comp = true;
+            } else if (argv[idx] == "-s"sv) {
+                opts.sparse = true;
+            } else if (argv[idx] == "-c"sv && idx + 1 < argc) {
+                string_view sel(argv[++idx]);
+                if (sel == "smallest")
+                    opts.select = comp_select::SMALLEST;
+                else if (sel == "fit")
+                    opts.select = comp_select::FIT;
+                else
+                    usage(argv[0]);
+            } else if (argv[idx] == "-f"sv && idx + 1 < argc) {
+                for (auto &name : split(argv[++idx], ",")) {
+                    format_t fmt = name2fmt[name];
+                    if (!COMPRESSED(fmt))
+                        usage(argv[0]);
+                    opts.formats.push_back(fmt);
+                }
+            } else {
                 usage(argv[0]);
-            repack(argv[3], argv[4] ? argv[4] : NEW_BOOT, true);
-        } else {
-            repack(argv[2], argv[3] ? argv[3] : NEW_BOOT);
+            }
         }
+        if (idx >= argc)
+            usage(argv[0]);
+        repack(argv[idx], argv[idx + 1] ? argv[idx + 1] : NEW_BOOT, opts);
+    } else if (argc > 2 && action == "patch") {
+        return boot_patch(argv[2], argv[3] ? argv[3] : NEW_BOOT);
     } else if (argc > 2 && action == "verify") {
         return verify(argv[2], argv[3]);
     } else if (argc > 2 && action == "sign") {
@@ -197,7 +344,22 @@ int main(int argc, char *argv[]) {
     } else if (argc > 2 && action == "decompress") {
         decompress(argv[2], argv[3]);
     } else if (argc > 2 && str_starts(action, "compress")) {
-        compress(action[8] == '=' ? &action[9] : "gzip", argv[2], argv[3]);
+        encoder_opts opts;
+        int idx = 2;
+        for (; idx + 2 < argc && argv[idx][0] == '-' && argv[idx][1]; idx += 2) {
+            if (argv[idx] == "-b"sv) {
+                opts.block_size = parse_size(argv[idx + 1]);
+                if (opts.block_size == 0 || opts.block_size == SIZE_MAX)
+                    usage(argv[0]);
+            } else if (argv[idx] == "-l"sv) {
+                if ((opts.level = parse_int(argv[idx + 1])) < 0)
+                    usage(argv[0]);
+            } else {
+                usage(argv[0]);
+            }
+        }
+        opts.blocks = opts.block_size != 0 || max_threads_set();
+        compress(action[8] == '=' ? &action[9] : "gzip", argv[idx], argv[idx + 1], opts);
     } else if (argc > 4 && action == "hexpatch") {
         return hexpatch(byte_view(argv[2]), byte_view(argv[3]), byte_view(argv[4])) ? 0 : 1;
     } else if (argc > 2 && action == "cpio") {
@@ -205,6 +367,12 @@ int main(int argc, char *argv[]) {
     } else if (argc > 3 && action == "dtb") {
         if (dtb_commands(argc - 2, argv + 2))
             usage(argv[0]);
+    } else if (action == "bench") {
+        return bench_commands(argc - 1, argv + 1);
+    } else if (argc > 2 && action == "info") {
+        return info_commands(argc - 1, argv + 1);
+    } else if (action == "batch") {
+        return batch_commands(argc - 1, argv + 1);
     } else if (argc > 2 && action == "extract") {
         return rust::extract_boot_from_payload(
                 argv[2],
@@ -0,0 +1,68 @@
+#include <unistd.h>
+#include <pthread.h>
+#include <atomic>
+#include <vector>
+
+#include <base.hpp>
+
+#include "parallel.hpp"
+
+using namespace std;
+
+static int thread_num = 0;
+static bool thread_num_set = false;
+
+int max_threads() {
+    if (thread_num <= 0) {
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+        thread_num = n > 0 ? n : 1;
+    }
+    return thread_num;
+}
+
+void set_max_threads(int n) {
+    thread_num = n;
+    thread_num_set = true;
+}
+
+bool max_threads_set() {
+    return thread_num_set;
+}
+
+namespace {
+
+struct parallel_ctx {
+    const function<void(size_t)> &fn;
+    const size_t n;
+    atomic_size_t next;
+};
+
+} // namespace
+
+static void *parallel_worker(void *arg) {
+    auto ctx = static_cast<parallel_ctx *>(arg);
+    for (size_t i; (i = ctx->next.fetch_add(1)) < ctx->n;) {
+        ctx->fn(i);
+    }
+    return nullptr;
+}
+
+void parallel_for(size_t n, const function<void(size_t)> &fn, int max) {
+    size_t threads = std::min<size_t>(n, max > 0 ? max : max_threads());
+    parallel_ctx ctx{fn, n, 0};
+
+    vector<pthread_t> workers;
+    for (size_t i = 1; i < threads; ++i) {
+        pthread_t thread;
+        // If we fail to spawn more threads, simply run with fewer workers
+        if (pthread_create(&thread, nullptr, parallel_worker, &ctx) != 0)
+            break;
+        workers.push_back(thread);
+    }
+
+    // The calling thread is also a worker
+    parallel_worker(&ctx);
+
+    for (pthread_t thread : workers)
+        pthread_join(thread, nullptr);
+}
@@ -0,0 +1,15 @@
+#pragma once
+
+#include <functional>
+
+// Maximum number of threads magiskboot is allowed to use for a single operation.
+// Defaults to the number of online CPUs; can be overridden with --threads=N
+int max_threads();
+void set_max_threads(int n);
+// Whether the number of threads was set explicitly with --threads=N
+bool max_threads_set();
+
+// Run fn(0) ... fn(n - 1) on at most max_threads() threads, including the calling thread.
+// Returns after all tasks are finished. Tasks are started in increasing index order.
+// A positive threads overrides max_threads() for this call only.
+void parallel_for(size_t n, const std::function<void(size_t)> &fn, int threads = 0);
@@ -34,7 +34,15 @@ macro_rules! match_patterns {
     }};
 }
 
-fn remove_pattern(buf: &mut [u8], pattern_matcher: unsafe fn(&[u8]) -> Option<usize>) -> usize {
+fn print_removed(pattern: &str) {
+    eprintln!("Remove pattern [{}]", pattern);
+}
+
+fn remove_pattern(
+    buf: &mut [u8],
+    pattern_matcher: unsafe fn(&[u8]) -> Option<usize>,
+    removed: &mut dyn FnMut(&str),
+) -> usize {
     let mut write = 0_usize;
     let mut read = 0_usize;
     let mut sz = buf.len();
@@ -45,7 +53,7 @@ fn remove_pattern(buf: &mut [u8], pattern_matcher: unsafe fn(&[u8]) -> Option<us
                 let skipped = buf.get_unchecked(read..(read + len));
                 // SAFETY: all matching patterns are ASCII bytes
                 let skipped = std::str::from_utf8_unchecked(skipped);
-                eprintln!("Remove pattern [{}]", skipped);
+                removed(skipped);
                 sz -= len;
                 read += len;
             } else {
@@ -61,20 +69,27 @@ fn remove_pattern(buf: &mut [u8], pattern_matcher: unsafe fn(&[u8]) -> Option<us
     sz
 }
 
+unsafe fn match_verity_pattern(buf: &[u8]) -> Option<usize> {
+    match_patterns!(
+        buf,
+        b"verifyatboot",
+        b"verify",
+        b"avb_keys",
+        b"avb",
+        b"support_scfs",
+        b"fsverity"
+    )
+}
+
 pub fn patch_verity(buf: &mut [u8]) -> usize {
-    unsafe fn match_verity_pattern(buf: &[u8]) -> Option<usize> {
-        match_patterns!(
-            buf,
-            b"verifyatboot",
-            b"verify",
-            b"avb_keys",
-            b"avb",
-            b"support_scfs",
-            b"fsverity"
-        )
-    }
+    remove_pattern(buf, match_verity_pattern, &mut print_removed)
+}
 
-    remove_pattern(buf, match_verity_pattern)
+// Same as patch_verity, but the messages are appended to log instead of printed
+pub fn patch_verity_log(buf: &mut [u8], log: &mut String) -> usize {
+    remove_pattern(buf, match_verity_pattern, &mut |pattern| {
+        log.push_str(&format!("Remove pattern [{}]\n", pattern))
+    })
 }
 
 pub fn patch_encryption(buf: &mut [u8]) -> usize {
@@ -82,7 +97,7 @@ pub fn patch_encryption(buf: &mut [u8]) -> usize {
         match_patterns!(buf, b"forceencrypt", b"forcefdeorfbe", b"fileencryption")
     }
 
-    remove_pattern(buf, match_encryption_pattern)
+    remove_pattern(buf, match_encryption_pattern, &mut print_removed)
 }
 
 fn hex2byte(hex: &[u8]) -> Vec<u8> {
@@ -101,6 +116,18 @@ fn hex2byte(hex: &[u8]) -> Vec<u8> {
     v
 }
 
+fn patch_hex(mut buf: &mut [u8], from: &Utf8CStr, to: &Utf8CStr) -> bool {
+    let pattern = hex2byte(from.as_bytes());
+    let patch = hex2byte(to.as_bytes());
+
+    let v = buf.patch(pattern.as_slice(), patch.as_slice());
+    for off in &v {
+        eprintln!("Patch @ {:#010X} [{}] -> [{}]", off, from, to);
+    }
+
+    !v.is_empty()
+}
+
 pub fn hexpatch(file: &[u8], from: &[u8], to: &[u8]) -> bool {
     fn inner(file: &[u8], from: &[u8], to: &[u8]) -> LoggedResult<bool> {
         let file = Utf8CStr::from_bytes(file)?;
@@ -108,15 +135,17 @@ pub fn hexpatch(file: &[u8], from: &[u8], to: &[u8]) -> bool {
         let to = Utf8CStr::from_bytes(to)?;
 
         let mut map = MappedFile::open_rw(file)?;
-        let pattern = hex2byte(from.as_bytes());
-        let patch = hex2byte(to.as_bytes());
-
-        let v = map.patch(pattern.as_slice(), patch.as_slice());
-        for off in &v {
-            eprintln!("Patch @ {:#010X} [{}] -> [{}]", off, from, to);
-        }
-
-        Ok(!v.is_empty())
+        Ok(patch_hex(map.as_mut(), from, to))
     }
     inner(file, from, to).unwrap_or(false)
 }
+
+// Same as hexpatch, but on a buffer in memory
+pub fn hexpatch_buf(buf: &mut [u8], from: &[u8], to: &[u8]) -> bool {
+    fn inner(buf: &mut [u8], from: &[u8], to: &[u8]) -> LoggedResult<bool> {
+        let from = Utf8CStr::from_bytes(from)?;
+        let to = Utf8CStr::from_bytes(to)?;
+        Ok(patch_hex(buf, from, to))
+    }
+    inner(buf, from, to).unwrap_or(false)
+}
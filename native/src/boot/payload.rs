@@ -1,18 +1,29 @@
+use std::borrow::Cow;
+use std::cmp::{max, min};
+use std::collections::{BTreeMap, VecDeque};
+use std::env;
 use std::fmt::Write as FmtWrite;
-use std::fs::File;
-use std::io::{BufReader, Read, Seek, SeekFrom, Write};
-use std::os::fd::{AsRawFd, FromRawFd};
+use std::fs::{self, File};
+use std::io::{self, BufReader, Read, Seek, SeekFrom, Write};
+use std::os::fd::{AsFd, AsRawFd, FromRawFd};
+use std::os::unix::fs::FileExt;
+use std::sync::{Condvar, Mutex};
+use std::thread;
 
 use byteorder::{BigEndian, ReadBytesExt};
 use quick_protobuf::{BytesReader, MessageRead};
+use sha2::{Digest, Sha256};
 
-use base::libc::c_char;
-use base::{error, LoggedError, LoggedResult, ReadSeekExt, StrErr, Utf8CStr};
-use base::{ResultExt, WriteExt};
+use base::libc::{self, c_char};
+use base::{error, warn, LoggedError, LoggedResult, ReadSeekExt, StrErr, Utf8CStr};
+use base::{MappedFile, ResultExt, WriteSeekExt};
 
+use crate::bspatch::bspatch;
 use crate::ffi;
 use crate::proto::update_metadata::mod_InstallOperation::Type;
-use crate::proto::update_metadata::DeltaArchiveManifest;
+use crate::proto::update_metadata::{
+    DeltaArchiveManifest, Extent, InstallOperation, PartitionUpdate,
+};
 
 macro_rules! bad_payload {
     ($msg:literal) => {{
@@ -69,15 +80,11 @@ fn do_extract_boot_from_payload(
         let mut br = BytesReader::from_bytes(manifest);
         DeltaArchiveManifest::from_reader(&mut br, manifest)?
     };
-    if manifest.get_minor_version() != 0 {
-        return Err(bad_payload!(
-            "delta payloads are not supported, please use a full payload file"
-        ));
-    }
-
     let block_size = manifest.get_block_size() as u64;
 
-    let partition = match partition_name {
+    // A list of partitions or "all" is extracted into a directory, a single one into a file
+    let multiple = partition_name.map_or(false, |s| s == "all" || s.contains(','));
+    let partitions: Vec<&PartitionUpdate> = match partition_name {
         None => {
             let boot = manifest
                 .partitions
@@ -90,55 +97,663 @@ fn do_extract_boot_from_payload(
                     .iter()
                     .find(|p| p.partition_name == "boot"),
             };
-            boot.ok_or_else(|| bad_payload!("boot partition not found"))?
+            vec![boot.ok_or_else(|| bad_payload!("boot partition not found"))?]
+        }
+        Some(name) if name == "all" => manifest.partitions.iter().collect(),
+        Some(names) => {
+            let mut partitions: Vec<&PartitionUpdate> = Vec::new();
+            for name in names.split(',').filter(|s| !s.is_empty()) {
+                if partitions.iter().any(|p| p.partition_name == name) {
+                    continue;
+                }
+                let partition = manifest
+                    .partitions
+                    .iter()
+                    .find(|p| p.partition_name == name)
+                    .ok_or_else(|| bad_payload!("partition '{}' not found", name))?;
+                partitions.push(partition);
+            }
+            partitions
         }
-        Some(name) => manifest
-            .partitions
-            .iter()
-            .find(|p| p.partition_name.as_str() == name)
-            .ok_or_else(|| bad_payload!("partition '{}' not found", name))?,
     };
+    if partitions.is_empty() {
+        return Err(bad_payload!("no partition to extract"));
+    }
 
-    let out_str: String;
-    let out_path = match out_path {
-        None => {
-            out_str = format!("{}.img", partition.partition_name);
-            out_str.as_str()
+    // Delta payloads are applied on top of the source images of the partitions.
+    // Everything is checked before any output file is created or truncated.
+    let mut sources = Vec::with_capacity(partitions.len());
+    for partition in partitions.iter() {
+        let mut needs_source = false;
+        for op in partition.operations.iter() {
+            match op.type_pb {
+                Type::REPLACE | Type::REPLACE_BZ | Type::REPLACE_XZ | Type::ZERO => {}
+                Type::SOURCE_COPY | Type::SOURCE_BSDIFF => needs_source = true,
+                t => {
+                    return Err(bad_payload!(
+                        "partition '{}' uses unsupported operation {:?}",
+                        partition.partition_name,
+                        t
+                    ))
+                }
+            }
         }
-        Some(s) => s,
-    };
+        sources.push(if needs_source {
+            Some(open_source(partition)?)
+        } else {
+            None
+        });
+    }
 
-    let mut out_file =
-        File::create(out_path).log_with_msg(|w| write!(w, "Cannot write to '{}'", out_path))?;
+    if multiple {
+        if let Some(dir) = out_path {
+            fs::create_dir_all(dir)
+                .log_with_msg(|w| write!(w, "Cannot create directory '{}'", dir))?;
+        }
+    }
+    let mut out_files = Vec::with_capacity(partitions.len());
+    let mut out_paths = Vec::with_capacity(partitions.len());
+    // Images are written to temporary names and only renamed once complete, so a
+    // failed extraction never leaves partial images behind under their usual names
+    let mut tmp_paths = TempPaths(Vec::with_capacity(partitions.len()));
+    for partition in partitions.iter() {
+        let out_path = match out_path {
+            Some(s) if !multiple => s.to_string(),
+            Some(dir) => format!("{}/{}.img", dir, partition.partition_name),
+            None => format!("{}.img", partition.partition_name),
+        };
+        let tmp_path = if multiple {
+            format!("{}.tmp", out_path)
+        } else {
+            out_path.clone()
+        };
+        // Readable as well, so the images can be hashed while being written
+        let out_file = File::options()
+            .read(true)
+            .write(true)
+            .create(true)
+            .truncate(true)
+            .open(&tmp_path)
+            .log_with_msg(|w| write!(w, "Cannot write to '{}'", tmp_path))?;
+        out_files.push(out_file);
+        out_paths.push(out_path);
+        if multiple {
+            tmp_paths.0.push(tmp_path);
+        }
+    }
 
     // Skip the manifest signature
     reader.skip(manifest_sig_len as usize)?;
 
-    // Sort the install operations with data_offset so we will only ever need to seek forward
-    // This makes it possible to support non-seekable input file descriptors
-    let mut operations = partition.operations.clone();
-    operations.sort_by_key(|e| e.data_offset.unwrap_or(0));
-    let mut curr_data_offset: u64 = 0;
+    // Hashes of operation data and of the new images are checked on request
+    let verify = env::var("EXTRACTVERIFY").map_or(false, |v| v == "true");
+
+    // If the input is a regular file, uncompressed data is copied within the kernel.
+    // Verification needs the data in memory, so it is not done in that case.
+    let in_file = match reader.get_ref().metadata() {
+        Ok(meta) if meta.is_file() && !verify => Some(reader.get_ref().try_clone()?),
+        _ => None,
+    };
+    let data_start = match in_file {
+        Some(_) => reader.stream_position()?,
+        None => 0,
+    };
+
+    // Merge the install operations of all partitions and sort them with data_offset
+    // so we will only ever need to seek forward and every image is written in one pass.
+    // This makes it possible to support non-seekable input file descriptors.
+    let mut operations: Vec<(usize, &InstallOperation)> = partitions
+        .iter()
+        .enumerate()
+        .flat_map(|(i, p)| p.operations.iter().map(move |op| (i, op)))
+        .collect();
+    operations.sort_by_key(|(_, e)| e.data_offset.unwrap_or(0));
+
+    // Operations are executed concurrently, so size the outputs upfront to make sure
+    // no worker ever has to extend a file while others are writing to it
+    for (i, (partition, out_file)) in partitions.iter().zip(out_files.iter()).enumerate() {
+        if !out_file.metadata()?.is_file() {
+            continue;
+        }
+        let mut out_size = partition
+            .new_partition_info
+            .as_ref()
+            .and_then(|info| info.size)
+            .unwrap_or(0);
+        for (_, op) in operations.iter().filter(|(p, _)| *p == i) {
+            for ext in op.dst_extents.iter() {
+                let end = ext.start_block.unwrap_or(0) + ext.num_blocks.unwrap_or(0);
+                out_size = max(out_size, end * block_size);
+            }
+        }
+        out_file.set_len(out_size)?;
+    }
+
+    let hashers = partitions
+        .iter()
+        .map(|p| {
+            if !verify {
+                return None;
+            }
+            let hasher = ImageHasher::new(p);
+            if hasher.is_none() {
+                warn!("No hash of partition '{}' to verify", p.partition_name);
+            }
+            hasher
+        })
+        .collect();
+
+    let job = ExtractJob {
+        operations,
+        in_file,
+        sources,
+        out_files,
+        hashers,
+        block_size,
+        verify,
+    };
+    let threads = max(ffi::max_threads(), 1) as usize;
+    let queue = OperationQueue::new(extract_buf_size());
+
+    thread::scope(|s| {
+        let workers: Vec<_> = (0..threads)
+            .map(|_| {
+                s.spawn(|| {
+                    let result = run_operations(&queue, &job);
+                    if result.is_err() {
+                        queue.fail();
+                    }
+                    result
+                })
+            })
+            .collect();
+
+        // Stream the data of all operations to the workers
+        let result = (|| -> LoggedResult<()> {
+            let mut curr_data_offset: u64 = 0;
+            for (i, (_, operation)) in job.operations.iter().enumerate() {
+                // Operations such as ZERO and SOURCE_COPY have no data
+                let data_len = operation.data_length.unwrap_or(0) as usize;
+                if data_len == 0 {
+                    if !queue.push(i, OperationData::Buffer(Vec::new())) {
+                        return Err(LoggedError::default());
+                    }
+                    continue;
+                }
+
+                let data_offset = operation
+                    .data_offset
+                    .ok_or_else(|| bad_payload!("data offset not found"))?;
+
+                // Skip to the next offset and read data
+                let skip = data_offset - curr_data_offset;
+                reader.skip(skip as usize)?;
+                let data = if job.in_file.is_some() && operation.type_pb == Type::REPLACE {
+                    reader.skip(data_len)?;
+                    OperationData::InFile(data_start + data_offset)
+                } else {
+                    let mut data = vec![0u8; data_len];
+                    reader.read_exact(&mut data)?;
+                    OperationData::Buffer(data)
+                };
+                curr_data_offset = data_offset + data_len as u64;
 
-    for operation in operations.iter() {
-        let data_len = operation
-            .data_length
-            .ok_or_else(|| bad_payload!("data length not found"))? as usize;
+                if !queue.push(i, data) {
+                    // A worker failed and already reported the error
+                    return Err(LoggedError::default());
+                }
+            }
+            Ok(())
+        })();
+        if result.is_err() {
+            queue.fail();
+        } else {
+            queue.close();
+        }
 
-        let data_offset = operation
-            .data_offset
-            .ok_or_else(|| bad_payload!("data offset not found"))?;
+        let result = workers.into_iter().fold(result, |r, w| {
+            r.and(w.join().unwrap_or(Err(LoggedError::default())))
+        });
+        result?;
+
+        // Hash whatever is left of each image, check it and give it its final name
+        let checks: Vec<_> = job
+            .hashers
+            .iter()
+            .zip(job.out_files.iter())
+            .zip(partitions.iter().zip(out_paths.iter()))
+            .enumerate()
+            .map(|(i, ((hasher, out_file), (partition, out_path)))| {
+                let tmp_path = tmp_paths.0.get(i).unwrap_or(out_path);
+                s.spawn(move || {
+                    let ok = match hasher {
+                        Some(hasher) => hasher.finish(out_file)?,
+                        None => true,
+                    };
+                    if ok {
+                        if tmp_path != out_path {
+                            fs::rename(tmp_path, out_path)
+                                .log_with_msg(|w| write!(w, "Cannot rename to '{}'", out_path))?;
+                        }
+                        Ok(())
+                    } else if out_file.metadata().map_or(false, |m| m.is_file())
+                        && fs::rename(tmp_path, format!("{}.bad", out_path)).is_ok()
+                    {
+                        // Do not leave a corrupted image behind under its usual name
+                        Err(bad_payload!(
+                            "hash mismatch of partition '{}', renamed to '{}.bad'",
+                            partition.partition_name,
+                            out_path
+                        ))
+                    } else {
+                        Err(bad_payload!(
+                            "hash mismatch of partition '{}'",
+                            partition.partition_name
+                        ))
+                    }
+                })
+            })
+            .collect();
+        checks.into_iter().fold(Ok(()), |r, c| {
+            r.and(c.join().unwrap_or(Err(LoggedError::default())))
+        })
+    })
+}
 
-        let data_type = operation.type_pb;
+// Temporary images that are removed unless they were renamed
+struct TempPaths(Vec<String>);
 
-        buf.resize(data_len, 0u8);
-        let data = &mut buf[..data_len];
+impl Drop for TempPaths {
+    fn drop(&mut self) {
+        for path in self.0.iter() {
+            fs::remove_file(path).ok();
+        }
+    }
+}
+
+// Everything the workers need to execute the operations
+struct ExtractJob<'a> {
+    // Operations of all partitions with the index of their partition
+    operations: Vec<(usize, &'a InstallOperation)>,
+    in_file: Option<File>,
+    sources: Vec<Option<MappedFile>>,
+    out_files: Vec<File>,
+    hashers: Vec<Option<ImageHasher>>,
+    block_size: u64,
+    verify: bool,
+}
+
+// Maximum size of operation data read ahead of the workers
+fn extract_buf_size() -> usize {
+    const DEFAULT_SIZE: usize = 64 << 20;
+    let Ok(val) = env::var("EXTRACTBUFSIZE") else {
+        return DEFAULT_SIZE;
+    };
+    match ffi::parse_size(val.as_bytes()) {
+        0 | usize::MAX => DEFAULT_SIZE,
+        n => n,
+    }
+}
+
+enum OperationData {
+    // Read into memory by the reader
+    Buffer(Vec<u8>),
+    // Left in the input file at this offset
+    InFile(u64),
+}
+
+impl OperationData {
+    // Memory held until the operation is done
+    fn mem_size(&self) -> usize {
+        match self {
+            OperationData::Buffer(buf) => buf.len(),
+            OperationData::InFile(_) => 0,
+        }
+    }
+}
 
-        // Skip to the next offset and read data
-        let skip = data_offset - curr_data_offset;
-        reader.skip(skip as usize)?;
-        reader.read_exact(data)?;
-        curr_data_offset = data_offset + data_len as u64;
+#[derive(Default)]
+struct QueueState {
+    jobs: VecDeque<(usize, OperationData)>,
+    // Size of all data that is queued or being processed
+    bytes: usize,
+    closed: bool,
+    failed: bool,
+}
+
+// Hands operation data from the reader to the workers, with bounded memory usage
+struct OperationQueue {
+    state: Mutex<QueueState>,
+    cond: Condvar,
+    budget: usize,
+}
+
+impl OperationQueue {
+    fn new(budget: usize) -> Self {
+        OperationQueue {
+            state: Mutex::default(),
+            cond: Condvar::new(),
+            budget,
+        }
+    }
+
+    // Blocks until the data fits in the budget. A single operation larger than the
+    // budget is still let through once nothing else is in flight.
+    fn push(&self, idx: usize, data: OperationData) -> bool {
+        let len = data.mem_size();
+        let mut st = self.state.lock().unwrap();
+        while !st.failed && st.bytes > 0 && st.bytes + len > self.budget {
+            st = self.cond.wait(st).unwrap();
+        }
+        if st.failed {
+            return false;
+        }
+        st.bytes += len;
+        st.jobs.push_back((idx, data));
+        self.cond.notify_all();
+        true
+    }
+
+    fn pop(&self) -> Option<(usize, OperationData)> {
+        let mut st = self.state.lock().unwrap();
+        loop {
+            if st.failed {
+                return None;
+            }
+            if let Some(job) = st.jobs.pop_front() {
+                return Some(job);
+            }
+            if st.closed {
+                return None;
+            }
+            st = self.cond.wait(st).unwrap();
+        }
+    }
+
+    fn done(&self, len: usize) {
+        self.state.lock().unwrap().bytes -= len;
+        self.cond.notify_all();
+    }
+
+    fn close(&self) {
+        self.state.lock().unwrap().closed = true;
+        self.cond.notify_all();
+    }
+
+    fn fail(&self) {
+        self.state.lock().unwrap().failed = true;
+        self.cond.notify_all();
+    }
+}
+
+// Source images are looked up as <partition>.img in SOURCEDIR
+fn open_source(partition: &PartitionUpdate) -> LoggedResult<MappedFile> {
+    let name = &partition.partition_name;
+    let Ok(dir) = env::var("SOURCEDIR") else {
+        return Err(bad_payload!(
+            "partition '{}' is a delta update, SOURCEDIR is required",
+            name
+        ));
+    };
+    let path = format!("{}/{}.img", dir, name);
+    let file = File::open(&path).log_with_msg(|w| write!(w, "Cannot open '{}'", path))?;
+    let size = file.metadata()?.len();
+    if let Some(expected) = partition.old_partition_info.as_ref().and_then(|i| i.size) {
+        if size < expected {
+            return Err(bad_payload!(
+                "source image '{}' is {} bytes, expected {}",
+                path,
+                size,
+                expected
+            ));
+        }
+    }
+    Ok(MappedFile::create(file.as_fd(), size as usize, false)?)
+}
+
+fn extents_len(extents: &[Extent], block_size: u64) -> LoggedResult<u64> {
+    let mut len = 0;
+    for ext in extents.iter() {
+        len += ext
+            .num_blocks
+            .ok_or_else(|| bad_payload!("num blocks not found"))?
+            * block_size;
+    }
+    Ok(len)
+}
+
+// Gather the src_extents of the operation from the source image and verify them
+fn read_source<'a>(
+    source: &'a Option<MappedFile>,
+    operation: &InstallOperation,
+    block_size: u64,
+) -> LoggedResult<Cow<'a, [u8]>> {
+    let source = source
+        .as_ref()
+        .ok_or_else(|| bad_payload!("source image not found"))?
+        .as_ref();
+    let mut slices = Vec::with_capacity(operation.src_extents.len());
+    for ext in operation.src_extents.iter() {
+        let start = ext
+            .start_block
+            .ok_or_else(|| bad_payload!("start block not found"))?
+            * block_size;
+        let end = start
+            + ext
+                .num_blocks
+                .ok_or_else(|| bad_payload!("num blocks not found"))?
+                * block_size;
+        if end > source.len() as u64 {
+            return Err(bad_payload!("src extents out of the source image"));
+        }
+        slices.push(&source[start as usize..end as usize]);
+    }
+    let src: Cow<[u8]> = match slices.as_slice() {
+        [slice] => Cow::Borrowed(slice),
+        _ => Cow::Owned(slices.concat()),
+    };
+
+    if let Some(hash) = &operation.src_sha256_hash {
+        if Sha256::digest(&src).as_slice() != hash.as_slice() {
+            return Err(bad_payload!(
+                "source hash mismatch, is the source image of the right build?"
+            ));
+        }
+    }
+
+    Ok(match (src, operation.src_length) {
+        (Cow::Borrowed(s), Some(len)) if len < s.len() as u64 => Cow::Borrowed(&s[..len as usize]),
+        (Cow::Owned(mut v), Some(len)) if len < v.len() as u64 => {
+            v.truncate(len as usize);
+            Cow::Owned(v)
+        }
+        (src, _) => src,
+    })
+}
+
+// Scatter data over the extents, in order
+fn write_extents(
+    out_file: &File,
+    extents: &[Extent],
+    data: &[u8],
+    block_size: u64,
+) -> LoggedResult<()> {
+    let mut data = data;
+    for ext in extents.iter() {
+        if data.is_empty() {
+            break;
+        }
+        let start = ext
+            .start_block
+            .ok_or_else(|| bad_payload!("start block not found"))?
+            * block_size;
+        let len = ext
+            .num_blocks
+            .ok_or_else(|| bad_payload!("num blocks not found"))?
+            * block_size;
+        let (chunk, rest) = data.split_at(min(len as usize, data.len()));
+        out_file.write_all_at(chunk, start)?;
+        data = rest;
+    }
+    if !data.is_empty() {
+        return Err(bad_payload!("dst extents too small"));
+    }
+    Ok(())
+}
+
+#[derive(Default)]
+struct HasherState {
+    // None while a worker is hashing
+    sha: Option<Sha256>,
+    // Size of the image prefix that is hashed
+    hashed: u64,
+    // Written ranges that are not hashed yet, start -> end
+    written: BTreeMap<u64, u64>,
+}
+
+// Hashes an image while it is being extracted. Operations finish out of order, so
+// the image is hashed whenever its written prefix grows, by the worker that grew it.
+struct ImageHasher {
+    state: Mutex<HasherState>,
+    size: u64,
+    expected: Vec<u8>,
+}
+
+impl ImageHasher {
+    fn new(partition: &PartitionUpdate) -> Option<Self> {
+        let info = partition.new_partition_info.as_ref()?;
+        Some(ImageHasher {
+            state: Mutex::new(HasherState {
+                sha: Some(Sha256::new()),
+                ..Default::default()
+            }),
+            size: info.size?,
+            expected: info.hash.clone()?,
+        })
+    }
+
+    fn written(&self, file: &File, extents: &[Extent], block_size: u64) -> io::Result<()> {
+        let mut st = self.state.lock().unwrap();
+        for ext in extents.iter() {
+            let start = ext.start_block.unwrap_or(0) * block_size;
+            let end = start + ext.num_blocks.unwrap_or(0) * block_size;
+            let e = st.written.entry(start).or_default();
+            *e = max(*e, end);
+        }
+        loop {
+            // Whoever is hashing will pick up the new ranges when done
+            let Some(mut sha) = st.sha.take() else {
+                return Ok(());
+            };
+            let start = st.hashed;
+            let mut end = start;
+            while let Some((&s, &e)) = st.written.first_key_value() {
+                if s > end {
+                    break;
+                }
+                st.written.pop_first();
+                end = max(end, e);
+            }
+            end = min(end, self.size);
+            if end <= start {
+                st.sha = Some(sha);
+                return Ok(());
+            }
+            drop(st);
+            let result = hash_file(&mut sha, file, start, end);
+            st = self.state.lock().unwrap();
+            st.sha = Some(sha);
+            st.hashed = end;
+            result?;
+        }
+    }
+
+    // Called after all operations are done
+    fn finish(&self, file: &File) -> io::Result<bool> {
+        let mut st = self.state.lock().unwrap();
+        let mut sha = st.sha.take().unwrap_or_default();
+        // Blocks not written by any operation are zero
+        hash_file(&mut sha, file, st.hashed, self.size)?;
+        st.hashed = self.size;
+        Ok(sha.finalize().as_slice() == self.expected.as_slice())
+    }
+}
+
+fn hash_file(sha: &mut Sha256, file: &File, start: u64, end: u64) -> io::Result<()> {
+    let mut buf = vec![0u8; min(end.saturating_sub(start), 1 << 20) as usize];
+    let mut off = start;
+    while off < end {
+        let len = min(end - off, buf.len() as u64) as usize;
+        file.read_exact_at(&mut buf[..len], off)?;
+        sha.update(&buf[..len]);
+        off += len as u64;
+    }
+    Ok(())
+}
+
+// Unlike try_clone, the new file does not share its offset with the original
+fn reopen(file: &File) -> io::Result<File> {
+    File::options()
+        .write(true)
+        .open(format!("/proc/self/fd/{}", file.as_raw_fd()))
+}
+
+fn reopened<'a>(fd: &'a mut Option<File>, file: &File) -> io::Result<&'a mut File> {
+    match fd {
+        Some(fd) => Ok(fd),
+        None => Ok(fd.insert(reopen(file)?)),
+    }
+}
+
+// Copy len bytes from in_file at in_offset to the current offset of out_fd,
+// without passing the data through userspace if possible
+fn send_file(in_file: &File, in_offset: u64, out_fd: &mut File, len: usize) -> io::Result<()> {
+    let mut off = in_offset as libc::off64_t;
+    let mut remain = len;
+    while remain > 0 {
+        let r =
+            unsafe { libc::sendfile64(out_fd.as_raw_fd(), in_file.as_raw_fd(), &mut off, remain) };
+        if r > 0 {
+            remain -= r as usize;
+            continue;
+        } else if r == 0 {
+            return Err(io::ErrorKind::UnexpectedEof.into());
+        }
+        let err = io::Error::last_os_error();
+        match err.raw_os_error() {
+            Some(libc::EINTR) => continue,
+            // Not supported by the file systems, copy the rest through a buffer
+            Some(libc::EINVAL) | Some(libc::ENOSYS) => break,
+            _ => return Err(err),
+        }
+    }
+    let mut buf = vec![0u8; min(remain, 1 << 20)];
+    while remain > 0 {
+        let len = min(remain, buf.len());
+        in_file.read_exact_at(&mut buf[..len], off as u64)?;
+        out_fd.write_all(&buf[..len])?;
+        off += len as libc::off64_t;
+        remain -= len;
+    }
+    Ok(())
+}
+
+fn run_operations(queue: &OperationQueue, job: &ExtractJob) -> LoggedResult<()> {
+    let block_size = job.block_size;
+    // Decompressors write at the current offset, so each worker needs its own
+    let mut out_fds: Vec<Option<File>> = job.out_files.iter().map(|_| None).collect();
+    while let Some((idx, data)) = queue.pop() {
+        let (part, operation) = job.operations[idx];
+        let out_file = &job.out_files[part];
+        let out_fd = &mut out_fds[part];
+
+        if job.verify {
+            if let (Some(hash), OperationData::Buffer(buf)) = (&operation.data_sha256_hash, &data) {
+                if !buf.is_empty() && Sha256::digest(buf).as_slice() != hash.as_slice() {
+                    return Err(bad_payload!("operation data hash mismatch"));
+                }
+            }
+        }
 
         let out_offset = operation
             .dst_extents
@@ -148,12 +763,40 @@ fn do_extract_boot_from_payload(
             .ok_or_else(|| bad_payload!("start block not found"))?
             * block_size;
 
-        match data_type {
-            Type::REPLACE => {
-                out_file.seek(SeekFrom::Start(out_offset))?;
-                out_file.write_all(data)?;
+        match (operation.type_pb, &data) {
+            (Type::REPLACE, OperationData::Buffer(buf)) => {
+                out_file.write_all_at(buf, out_offset)?;
             }
-            Type::ZERO => {
+            (Type::REPLACE, OperationData::InFile(in_offset)) => {
+                let in_file = job
+                    .in_file
+                    .as_ref()
+                    .ok_or_else(|| bad_payload!("input is not a file"))?;
+                let out_fd = reopened(out_fd, out_file)?;
+                out_fd.seek(SeekFrom::Start(out_offset))?;
+                send_file(
+                    in_file,
+                    *in_offset,
+                    out_fd,
+                    operation.data_length.unwrap_or(0) as usize,
+                )?;
+            }
+            (Type::SOURCE_COPY, _) => {
+                let src = read_source(&job.sources[part], operation, block_size)?;
+                write_extents(out_file, &operation.dst_extents, &src, block_size)?;
+            }
+            (Type::SOURCE_BSDIFF, OperationData::Buffer(patch)) => {
+                let src = read_source(&job.sources[part], operation, block_size)?;
+                let dst_len = match operation.dst_length {
+                    Some(len) => len,
+                    None => extents_len(&operation.dst_extents, block_size)?,
+                };
+                let mut dst = vec![0u8; dst_len as usize];
+                bspatch(&src, patch, &mut dst)?;
+                write_extents(out_file, &operation.dst_extents, &dst, block_size)?;
+            }
+            (Type::ZERO, _) => {
+                let out_fd = reopened(out_fd, out_file)?;
                 for ext in operation.dst_extents.iter() {
                     let out_seek = ext
                         .start_block
@@ -162,20 +805,24 @@ fn do_extract_boot_from_payload(
                     let num_blocks = ext
                         .num_blocks
                         .ok_or_else(|| bad_payload!("num blocks not found"))?;
-                    out_file.seek(SeekFrom::Start(out_seek))?;
-                    out_file.write_zeros(num_blocks as usize)?;
+                    out_fd.seek(SeekFrom::Start(out_seek))?;
+                    out_fd.write_hole((num_blocks * block_size) as usize)?;
                 }
             }
-            Type::REPLACE_BZ | Type::REPLACE_XZ => {
-                out_file.seek(SeekFrom::Start(out_offset))?;
-                if !ffi::decompress(data, out_file.as_raw_fd()) {
+            (Type::REPLACE_BZ | Type::REPLACE_XZ, OperationData::Buffer(buf)) => {
+                let out_fd = reopened(out_fd, out_file)?;
+                out_fd.seek(SeekFrom::Start(out_offset))?;
+                if !ffi::decompress(buf, out_fd.as_raw_fd()) {
                     return Err(bad_payload!("decompression failed"));
                 }
             }
             _ => return Err(bad_payload!("unsupported operation type")),
         };
+        if let Some(hasher) = &job.hashers[part] {
+            hasher.written(out_file, &operation.dst_extents, block_size)?;
+        }
+        queue.done(data.mem_size());
     }
-
     Ok(())
 }
 
@@ -4,10 +4,11 @@ use std::env;
 use std::str::from_utf8;
 
 use base::libc::{S_IFDIR, S_IFMT, S_IFREG};
-use base::{LoggedResult, Utf8CStr};
+use base::{log_err, LoggedResult, Utf8CStr};
 
 use crate::cpio::{Cpio, CpioEntry};
 use crate::patch::{patch_encryption, patch_verity};
+use crate::sign::sha1_hash;
 
 pub trait MagiskCpio {
     fn patch(&mut self);
@@ -121,6 +122,14 @@ impl MagiskCpio for Cpio {
     }
 
     fn backup(&mut self, origin: &Utf8CStr) -> LoggedResult<()> {
+        let o = Cpio::load_from_file(origin)?;
+        self.backup_from(o);
+        Ok(())
+    }
+}
+
+impl Cpio {
+    fn backup_from(&mut self, mut o: Cpio) {
         let mut backups = HashMap::<String, Box<CpioEntry>>::new();
         let mut rm_list = String::new();
         backups.insert(
@@ -134,7 +143,6 @@ impl MagiskCpio for Cpio {
                 data: vec![],
             }),
         );
-        let mut o = Cpio::load_from_file(origin)?;
         o.rm(".backup", true);
         self.rm(".backup", true);
 
@@ -201,7 +209,145 @@ impl MagiskCpio for Cpio {
             );
         }
         self.entries.extend(backups);
+    }
+}
 
-        Ok(())
+// Does everything scripts/boot_patch.sh does to the ramdisk, in memory. The xz
+// compressed magisk binaries are optional, an empty slice is the same as a missing
+// file. Returns the new ramdisk, or an empty vector on failure.
+pub fn patch_ramdisk(
+    image: &[u8],
+    ramdisk: &[u8],
+    magiskinit: &[u8],
+    magisk32_xz: &[u8],
+    magisk64_xz: &[u8],
+    stub_xz: &[u8],
+) -> Vec<u8> {
+    fn inner(
+        image: &[u8],
+        ramdisk: &[u8],
+        magiskinit: &[u8],
+        magisk32_xz: &[u8],
+        magisk64_xz: &[u8],
+        stub_xz: &[u8],
+    ) -> LoggedResult<Vec<u8>> {
+        eprintln!("- Checking ramdisk status");
+        // Stock A only legacy SAR, or some Android 13 GKIs have no ramdisk at all
+        let skip_backup = ramdisk.is_empty();
+        let mut cpio = if skip_backup {
+            Cpio::new()
+        } else {
+            Cpio::load_from_data(ramdisk)?
+        };
+        let status = if skip_backup { 0 } else { cpio.test() };
+
+        let mut sha1 = String::new();
+        let mut preinit_device = env::var("PREINITDEVICE").unwrap_or_default();
+        match status & 3 {
+            0 => {
+                eprintln!("- Stock boot image detected");
+                let mut digest = [0_u8; 20];
+                sha1_hash(image, &mut digest);
+                sha1 = digest.iter().map(|b| format!("{:02x}", b)).collect();
+            }
+            MAGISK_PATCHED => {
+                eprintln!("- Magisk patched boot image detected");
+                // Without the previous configs, the script fails to extract them
+                // and leaves the ramdisk as is
+                let config = cpio
+                    .entries
+                    .get(".backup/.magisk")
+                    .map(|e| String::from_utf8_lossy(&e.data).into_owned());
+                if let Some(config) = config {
+                    let prop = |key: &str| {
+                        config
+                            .split('\n')
+                            .find_map(|l| l.strip_prefix(key)?.strip_prefix('='))
+                            .unwrap_or_default()
+                            .to_string()
+                    };
+                    sha1 = prop("SHA1");
+                    // Do not inherit config if not in recovery
+                    if !check_env("BOOTMODE") {
+                        preinit_device = prop("PREINITDEVICE");
+                    }
+                    cpio.restore()?;
+                }
+            }
+            _ => {
+                return Err(log_err!(
+                    "! Boot image patched by unsupported programs\n\
+                     ! Please restore back to stock boot image"
+                ));
+            }
+        }
+        let origin = if skip_backup {
+            None
+        } else {
+            Some(cpio.clone())
+        };
+
+        // Workaround custom legacy Sony /init -> /(s)bin/init_sony : /init.real setup
+        let init = if status & SONY_INIT != 0 {
+            "init.real"
+        } else {
+            "init"
+        };
+
+        eprintln!("- Patching ramdisk");
+        if magiskinit.is_empty() || stub_xz.is_empty() {
+            return Err(log_err!("! Unable to patch ramdisk"));
+        }
+
+        let flag = |key: &str| match env::var(key) {
+            Ok(v) if !v.is_empty() => v,
+            _ => "false".to_string(),
+        };
+        let mut config = String::new();
+        for key in [
+            "KEEPVERITY",
+            "KEEPFORCEENCRYPT",
+            "PATCHVBMETAFLAG",
+            "RECOVERYMODE",
+        ] {
+            config.push_str(&format!("{}={}\n", key, flag(key)));
+        }
+        if !preinit_device.is_empty() {
+            eprintln!("- Pre-init storage partition: {}", preinit_device);
+            config.push_str(&format!("PREINITDEVICE={}\n", preinit_device));
+        }
+        if !sha1.is_empty() {
+            config.push_str(&format!("SHA1={}\n", sha1));
+        }
+
+        cpio.add_data(&0o750, init, magiskinit.to_vec());
+        cpio.mkdir(&0o750, "overlay.d");
+        cpio.mkdir(&0o750, "overlay.d/sbin");
+        if !magisk32_xz.is_empty() {
+            cpio.add_data(&0o644, "overlay.d/sbin/magisk32.xz", magisk32_xz.to_vec());
+        }
+        if !magisk64_xz.is_empty() {
+            cpio.add_data(&0o644, "overlay.d/sbin/magisk64.xz", magisk64_xz.to_vec());
+        }
+        cpio.add_data(&0o644, "overlay.d/sbin/stub.xz", stub_xz.to_vec());
+        cpio.patch();
+        if let Some(origin) = origin {
+            cpio.backup_from(origin);
+        }
+        cpio.mkdir(&0o000, ".backup");
+        cpio.add_data(&0o000, ".backup/.magisk", config.into_bytes());
+
+        let mut out = Vec::new();
+        cpio.write_to(&mut out)?;
+        Ok(out)
     }
+    inner(
+        image,
+        ramdisk,
+        magiskinit,
+        magisk32_xz,
+        magisk64_xz,
+        stub_xz,
+    )
+    .unwrap_or(Vec::new())
 }
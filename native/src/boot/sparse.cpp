@@ -0,0 +1,104 @@
+#include <base.hpp>
+
+#include "magiskboot.hpp"
+
+using namespace std;
+
+// Android sparse image format, see system/core/libsparse/sparse_format.h
+
+#define SPARSE_HEADER_MAGIC 0xed26ff3a
+#define CHUNK_TYPE_RAW      0xCAC1
+#define CHUNK_TYPE_FILL     0xCAC2
+
+struct sparse_header {
+    uint32_t magic;
+    uint16_t major_version;
+    uint16_t minor_version;
+    uint16_t file_hdr_sz;
+    uint16_t chunk_hdr_sz;
+    uint32_t blk_sz;
+    uint32_t total_blks;
+    uint32_t total_chunks;
+    uint32_t image_checksum;
+} __attribute__((packed));
+
+struct chunk_header {
+    uint16_t chunk_type;
+    uint16_t reserved1;
+    uint32_t chunk_sz;
+    uint32_t total_sz;
+} __attribute__((packed));
+
+// Keep the byte size of raw chunks within 32 bits
+#define MAX_RAW_SZ (1U << 30)
+
+// Whether the block is a single 32-bit value repeated
+static bool is_fill(const uint8_t *blk, uint32_t blk_sz, uint32_t &val) {
+    memcpy(&val, blk, sizeof(val));
+    return memcmp(blk, blk + sizeof(val), blk_sz - sizeof(val)) == 0;
+}
+
+bool write_sparse(const char *file, uint32_t blk_sz) {
+    string tmp = file + ".sparse"s;
+    {
+        mmap_data raw(file);
+        int fd = xopen(tmp.data(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0)
+            return false;
+
+        sparse_header hdr{};
+        hdr.magic = SPARSE_HEADER_MAGIC;
+        hdr.major_version = 1;
+        hdr.file_hdr_sz = sizeof(sparse_header);
+        hdr.chunk_hdr_sz = sizeof(chunk_header);
+        hdr.blk_sz = blk_sz;
+        hdr.total_blks = align_to(raw.sz(), blk_sz) / blk_sz;
+        lseek(fd, sizeof(hdr), SEEK_SET);
+
+        // The last block is zero padded if the image size is not block aligned
+        size_t nblk = hdr.total_blks;
+        vector<uint8_t> tail;
+        if (raw.sz() % blk_sz) {
+            tail.resize(blk_sz);
+            memcpy(tail.data(), raw.buf() + (nblk - 1) * blk_sz, raw.sz() % blk_sz);
+        }
+        auto block = [&](size_t i) -> const uint8_t * {
+            return !tail.empty() && i == nblk - 1 ? tail.data() : raw.buf() + i * blk_sz;
+        };
+
+        uint32_t val, next;
+        for (size_t i = 0, j; i < nblk; i = j) {
+            chunk_header c{};
+            if (is_fill(block(i), blk_sz, val)) {
+                for (j = i + 1; j < nblk && is_fill(block(j), blk_sz, next) && next == val; ++j);
+                c.chunk_type = CHUNK_TYPE_FILL;
+                c.chunk_sz = j - i;
+                c.total_sz = sizeof(c) + sizeof(val);
+                xwrite(fd, &c, sizeof(c));
+                xwrite(fd, &val, sizeof(val));
+            } else {
+                for (j = i + 1; j < nblk && (j - i) * blk_sz < MAX_RAW_SZ &&
+                                !is_fill(block(j), blk_sz, next); ++j);
+                c.chunk_type = CHUNK_TYPE_RAW;
+                c.chunk_sz = j - i;
+                c.total_sz = sizeof(c) + c.chunk_sz * blk_sz;
+                xwrite(fd, &c, sizeof(c));
+                if (j == nblk && !tail.empty()) {
+                    xwrite(fd, raw.buf() + i * blk_sz, (j - 1 - i) * blk_sz);
+                    xwrite(fd, tail.data(), blk_sz);
+                } else {
+                    xwrite(fd, raw.buf() + i * blk_sz, (j - i) * blk_sz);
+                }
+            }
+            ++hdr.total_chunks;
+        }
+
+        bool ok = pwrite(fd, &hdr, sizeof(hdr), 0) == sizeof(hdr);
+        close(fd);
+        if (!ok) {
+            unlink(tmp.data());
+            return false;
+        }
+    }
+    return rename(tmp.data(), file) == 0;
+}